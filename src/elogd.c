@@ -51,8 +51,19 @@ char *return_buffer;
 int return_buffer_size;
 int strlen_retbuf;
 int keep_alive;
+int http_1_1;
+int chunked_output;
+int request_child;              /* running in a process started by fork_request() */
+int request_forked;             /* current request has been passed to a child process */
+int n_request_child;
 char header_buffer[20000];
 int return_length;
+int return_file = -1;           /* file sent as body after the header in return_buffer */
+int return_file_size;
+int n_return_range;             /* parts of the file sent, several ones as multipart/byteranges */
+int return_range[N_MAX_RANGE][2];
+char return_range_type[256];
+char return_boundary[40];
 char host_name[256];
 char referer[256];
 char browser[256];
@@ -63,6 +74,8 @@ char listen_interface[256];
 char theme_name[80];
 char http_host[256];
 char http_user[256];
+char http_range[256];
+char http_if_range[256];
 
 char _param[MAX_PARAM][NAME_LENGTH];
 char _value[MAX_PARAM][NAME_LENGTH];
@@ -397,13 +410,31 @@ long my_timezone()
 {
 #if defined(OS_MACOSX) || defined(__FreeBSD__) || defined(__OpenBSD__)
    time_t tp;
+   struct tm tms;
+
+   /* localtime_r() since this gets called from index threads */
    time(&tp);
-   return -localtime(&tp)->tm_gmtoff;
+   localtime_r(&tp, &tms);
+   return -tms.tm_gmtoff;
 #else
    return timezone;
 #endif
 }
 
+/*---- Wall clock time in seconds ---*/
+
+double get_wall_time()
+{
+#ifdef OS_WINNT
+   return GetTickCount() / 1000.0;
+#else
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1E6;
+#endif
+}
+
 /*---- Compose RFC2822 compliant date ---*/
 
 void get_rfc2822_date(char *date, int size, time_t ltime)
@@ -1867,28 +1898,78 @@ int send_with_timeout(void *p, int sock, char *buf, int buf_size)
 
 /*-------------------------------------------------------------------*/
 
-int recv_string(int sock, char *buffer, int buffer_size, int millisec)
+int send_file_body(void *p, int sock, int fh, int offset, int length)
+/* send part of a file without loading it into memory, through sendfile() for plain
+   connections or from a small buffer for SSL ones, return number of bytes sent */
 {
-   int i, n;
+   int n, sent;
+   char *buf;
+#ifdef HAVE_SENDFILE
+   off_t pos;
+
+   if (p == NULL) {
+      pos = offset;
+      for (sent = 0; sent < length; sent += n) {
+         n = sendfile(sock, fh, &pos, length - sent);
+         if (n == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+         }
+         if (n <= 0)
+            break;
+      }
+      return sent;
+   }
+#endif
+
+   buf = xmalloc(65536);
+   lseek(fh, offset, SEEK_SET);
+   for (sent = 0; sent < length; sent += n) {
+      n = read(fh, buf, length - sent < 65536 ? length - sent : 65536);
+      if (n <= 0 || send_with_timeout(p, sock, buf, n) < n)
+         break;
+   }
+   xfree(buf);
+
+   return sent;
+}
+
+/*-------------------------------------------------------------------*/
+
+BOOL wait_socket(int sock, int millisec)
+/* wait up to millisec for data on socket, return TRUE if there is some; unlike select(),
+   poll() also works for sockets above FD_SETSIZE */
+{
+#ifdef OS_UNIX
+   struct pollfd pfd;
+
+   pfd.fd = sock;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   return poll(&pfd, 1, millisec) > 0 && pfd.revents != 0;
+#else
    fd_set readfds;
    struct timeval timeout;
 
+   FD_ZERO(&readfds);
+   FD_SET(sock, &readfds);
+   timeout.tv_sec = millisec / 1000;
+   timeout.tv_usec = (millisec % 1000) * 1000;
+   select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
+   return FD_ISSET(sock, &readfds) != 0;
+#endif
+}
+
+int recv_string(int sock, char *buffer, int buffer_size, int millisec)
+{
+   int i, n;
+
    n = 0;
    memset(buffer, 0, buffer_size);
 
    do {
-      if (millisec > 0) {
-         FD_ZERO(&readfds);
-         FD_SET(sock, &readfds);
-
-         timeout.tv_sec = millisec / 1000;
-         timeout.tv_usec = (millisec % 1000) * 1000;
-
-         select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
-
-         if (!FD_ISSET(sock, &readfds))
-            break;
-      }
+      if (millisec > 0 && !wait_socket(sock, millisec))
+         break;
 
       i = recv(sock, buffer + n, 1, 0);
 
@@ -2527,8 +2608,6 @@ int retrieve_url(LOGBOOK * lbs, const char *url, int ssl, char **buffer)
    char str[1000], unm[256], upwd[256], host[256], subdir[256], param[256];
    int port, bufsize;
    int i, n;
-   fd_set readfds;
-   struct timeval timeout;
 #ifdef HAVE_SSL
    static SSL *ssl_con = NULL;
 #else
@@ -2612,15 +2691,8 @@ int retrieve_url(LOGBOOK * lbs, const char *url, int ssl, char **buffer)
    n = 0;
 
    do {
-      FD_ZERO(&readfds);
-      FD_SET(sock, &readfds);
-
-      timeout.tv_sec = 30;      /* 30 sec. timeout */
-      timeout.tv_usec = 0;
-
-      select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
-
-      if (!FD_ISSET(sock, &readfds)) {
+      /* 30 sec. timeout */
+      if (!wait_socket(sock, 30000)) {
          closesocket(sock);
          sock = 0;
          xfree(*buffer);
@@ -3827,232 +3899,1406 @@ int eli_compare(const void *e1, const void *e2)
 
 /*------------------------------------------------------------------*/
 
-void generate_subdir_name(char *file_name, char *subdir, int size)
+/* hash table mapping message IDs to positions in el_index, shared by logbooks with the same index */
+
+#define EL_ID_HASH_MIN_SIZE 64
+
+static unsigned int el_id_hash_key(int message_id, int size)
 {
-   char fn[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
-   int year;
-   
-   // extract path from file_name
-   strlcpy(path, file_name, size);
-   if (strrchr(path, DIR_SEPARATOR))
-      *(strrchr(path, DIR_SEPARATOR)+1) = 0;
-   
-   // extract file name
-   if (strrchr(file_name, DIR_SEPARATOR))
-      strlcpy(fn, strrchr(file_name, DIR_SEPARATOR)+1, sizeof(fn));
-   else
-      strlcpy(fn, file_name, sizeof(fn));
-   
-   // create subdir from name
-   year = (fn[0]-'0')*10+(fn[1]-'0');
-   // month = (fn[2]-'0')*10+(fn[3]-'0');
-   if (year < 80)
-      sprintf(subdir, "20%02d", year);
-   else
-      sprintf(subdir, "19%02d", year);
-   
-   strlcat(subdir, DIR_SEPARATOR_STR, size);
+   return ((unsigned int) message_id * 2654435761U) & (size - 1);
 }
 
-/*------------------------------------------------------------------*/
-
-int restructure_dir(char *dir)
+static void el_id_hash_put(EL_ID_HASH * hash, EL_INDEX * eli, int index)
 {
-   char *file_list;
-   int n1, n2, index, status;
-   char old_path[MAX_PATH_LENGTH], new_path[MAX_PATH_LENGTH],
-   subdir[MAX_PATH_LENGTH];
-   static int first = TRUE;
-   
-   /* go through all entry files */
-   n1 = ss_file_find(dir, "??????a.log", &file_list);
-   for (index = 0; index < n1; index++) {
-      generate_subdir_name(file_list + index * MAX_PATH_LENGTH, subdir, sizeof(subdir));
+   unsigned int h;
 
-      // create new subdir
-      strlcpy(new_path, dir, MAX_PATH_LENGTH);
-      strlcat(new_path, subdir, MAX_PATH_LENGTH);
-      
-#ifdef OS_WINNT
-      status = mkdir(new_path);
-#else
-      status = mkdir(new_path, 0755);
-#endif
-      
-      if (status == 0) {
-         if (first) {
-            eprintf("\nFound old directory structure. Creating subdirectories and moving files...\n");
-            first = FALSE;
-         }
-         eprintf("Created directory \"%s\"\n", new_path);
-      } else {
-         if (errno != EEXIST) {
-            eprintf("generate_subdir_name: %s\n", strerror(errno));
-            eprintf("Cannot create directory \"%s\"\n", new_path);
-         }
+   for (h = el_id_hash_key(eli[index].message_id, hash->size); hash->slot[h]; h = (h + 1) & (hash->size - 1)) {
+      /* replace duplicate ID, last one wins */
+      if (eli[hash->slot[h] - 1].message_id == eli[index].message_id) {
+         hash->slot[h] = index + 1;
+         return;
       }
-      
-      strlcpy(old_path, dir, sizeof(old_path));
-      strlcat(old_path, file_list + index * MAX_PATH_LENGTH, sizeof(old_path));
-      strlcpy(new_path, dir, sizeof(new_path));
-      strlcat(new_path, subdir, sizeof(new_path));
-      strlcat(new_path, file_list + index * MAX_PATH_LENGTH, sizeof(new_path));
-      
-      rename(old_path, new_path);
    }
-   if (file_list)
-      xfree(file_list);
-   
-   /* go through all attachment files */
-   n2 = ss_file_find(dir, "??????_??????_*", &file_list);
-   for (index = 0; index < n2; index++) {
-      generate_subdir_name(file_list + index * MAX_PATH_LENGTH, subdir, sizeof(subdir));
 
-      // create new subdir
-      strlcpy(new_path, dir, MAX_PATH_LENGTH);
-      strlcat(new_path, subdir, MAX_PATH_LENGTH);
-      
-#ifdef OS_WINNT
-      status = mkdir(new_path);
-#else
-      status = mkdir(new_path, 0755);
-#endif
-      
-      strlcpy(old_path, dir, sizeof(old_path));
-      strlcat(old_path, file_list + index * MAX_PATH_LENGTH, sizeof(old_path));
-      strlcpy(new_path, dir, sizeof(new_path));
-      strlcat(new_path, subdir, sizeof(new_path));
-      strlcat(new_path, file_list + index * MAX_PATH_LENGTH, sizeof(new_path));
-      
-      rename(old_path, new_path);
+   hash->slot[h] = index + 1;
+   hash->n++;
+   if (eli[index].message_id > hash->max_id)
+      hash->max_id = eli[index].message_id;
+}
+
+void el_id_hash_rebuild(LOGBOOK * lbs)
+/* rebuild hash table after index has been sorted or entries have been removed */
+{
+   EL_ID_HASH *hash;
+   int i, size;
+
+   hash = lbs->id_hash;
+   for (size = EL_ID_HASH_MIN_SIZE; size < 2 * *lbs->n_el_index; size *= 2);
+
+   if (hash->size != size) {
+      xfree(hash->slot);
+      hash->slot = xmalloc(sizeof(int) * size);
+      hash->size = size;
    }
-   if (file_list)
-      xfree(file_list);
+   memset(hash->slot, 0, sizeof(int) * size);
+   hash->n = 0;
+   hash->max_id = 0;
 
-   return n1+n2;
+   for (i = 0; i < *lbs->n_el_index; i++)
+      el_id_hash_put(hash, lbs->el_index, i);
 }
 
-/*------------------------------------------------------------------*/
+void el_id_hash_add(LOGBOOK * lbs, int index)
+/* add index entry appended at position "index" */
+{
+   if (2 * (lbs->id_hash->n + 1) > lbs->id_hash->size)
+      el_id_hash_rebuild(lbs);
+   else
+      el_id_hash_put(lbs->id_hash, lbs->el_index, index);
+}
 
-int parse_file(LOGBOOK *lbs, char *file_name)
+int el_find_index(LOGBOOK * lbs, int message_id)
+/* return position of message in el_index, or -1 if not found */
 {
-   char str[256], date[256], *buffer, *p, *pn, in_reply_to[80];
-   int length, i, fh, len;
-   
-   fh = open(file_name, O_RDONLY | O_BINARY, 0644);
-   
-   if (fh < 0) {
-      sprintf(str, "Cannot open file \"%s\"", file_name);
-      eprintf("%s; %s\n", str, strerror(errno));
-      return EL_FILE_ERROR;
-   }
-   
-   /* read file into buffer */
-   length = lseek(fh, 0, SEEK_END);
-   
-   if (length > 0) {
-      buffer = xmalloc(length + 1);
-      lseek(fh, 0, SEEK_SET);
-      read(fh, buffer, length);
-      buffer[length] = 0;
-      close(fh);
-      
-      /* go through buffer */
-      p = buffer;
-      
-      do {
-         p = strstr(p, "$@MID@$:");
-         
-         if (p) {
-            lbs->el_index = xrealloc(lbs->el_index, sizeof(EL_INDEX) * (*lbs->n_el_index + 1));
-            if (lbs->el_index == NULL) {
-               eprintf("Not enough memory to allocate entry index\n");
-               return EL_MEM_ERROR;
-            }
-            
-            strlcpy(lbs->el_index[*lbs->n_el_index].subdir, file_name+strlen(lbs->data_dir), 256);
-            if (strrchr(lbs->el_index[*lbs->n_el_index].subdir, DIR_SEPARATOR))
-               *(strrchr(lbs->el_index[*lbs->n_el_index].subdir, DIR_SEPARATOR)+1) = 0;
-            
-            if (strrchr(file_name, DIR_SEPARATOR))
-               strlcpy(str, strrchr(file_name, DIR_SEPARATOR)+1, sizeof(str));
-            else
-               strlcpy(str, file_name, sizeof(str));
-            strcpy(lbs->el_index[*lbs->n_el_index].file_name, str);
-            
-            el_decode(p, "Date: ", date, sizeof(date));
-            el_decode_int(p, "In reply to: ", in_reply_to, sizeof(in_reply_to));
-            
-            lbs->el_index[*lbs->n_el_index].file_time = date_to_ltime(date);
-            
-            lbs->el_index[*lbs->n_el_index].message_id = atoi(p + 8);
-            lbs->el_index[*lbs->n_el_index].offset = p - buffer;
-            lbs->el_index[*lbs->n_el_index].in_reply_to = atoi(in_reply_to);
-            
-            pn = strstr(p + 8, "$@MID@$:");
-            if (pn)
-               len = pn - p;
-            else
-               len = strlen(p);
-            
-            MD5_checksum(p, len, lbs->el_index[*lbs->n_el_index].md5_digest);
-            
-            if (lbs->el_index[*lbs->n_el_index].message_id > 0) {
-               if (get_verbose() == VERBOSE_DEBUG) {
-                  eprintf("  ID %3d, %s, ofs %5d, %s, MD5=", lbs->el_index[*lbs->n_el_index].message_id,
-                          str, lbs->el_index[*lbs->n_el_index].offset,
-                          lbs->el_index[*lbs->n_el_index].in_reply_to ? "reply" : "thead");
-                  
-                  for (i = 0; i < 16; i++)
-                     eprintf("%02X", lbs->el_index[*lbs->n_el_index].md5_digest[i]);
-                  eprintf("\n");
-               }
-               
-               /* valid ID */
-               (*lbs->n_el_index)++;
-            }
-            
-            p += 8;
-         }
-         
-      } while (p);
-      
-      xfree(buffer);
+   EL_ID_HASH *hash;
+   unsigned int h;
+
+   hash = lbs->id_hash;
+   if (hash == NULL || hash->size == 0 || message_id <= 0)
+      return -1;
+
+   for (h = el_id_hash_key(message_id, hash->size); hash->slot[h]; h = (h + 1) & (hash->size - 1))
+      if (lbs->el_index[hash->slot[h] - 1].message_id == message_id)
+         return hash->slot[h] - 1;
+
+   return -1;
+}
+
+int el_find_time(LOGBOOK * lbs, time_t ltime)
+/* return position of first message in el_index with a date after ltime, the index is sorted by date */
+{
+   int lo, hi, mid;
+
+   lo = 0;
+   hi = *lbs->n_el_index;
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (lbs->el_index[mid].file_time > ltime)
+         hi = mid;
+      else
+         lo = mid + 1;
    }
-   
-   return SUCCESS;
+
+   return lo;
 }
 
-/*------------------------------------------------------------------*/
+/* Threads are kept in the index as well. The thread head of an entry is the
+   ID found by following in_reply_to up to an entry which is no reply, or up
+   to the first ID which is not in the index, like find_thread_head() did.
+   The replies to an entry form a list through first_reply and next_reply,
+   holding message IDs, so they stay valid when the index gets sorted. */
 
-int scan_dir_tree(LOGBOOK *lbs, const char *dir, char **file_list, int *n)
+static void el_thread_set_head(LOGBOOK * lbs, int index, int head)
+/* set thread head of an entry and of all replies below it */
 {
-   int  index, n_files;
-   char str[MAX_PATH_LENGTH];
-   char *fl, *p;
-   
-   fl = NULL;
-   n_files = ss_file_find(dir, "*", &fl);
-   if (n_files == 0) {
-      if (fl)
-         xfree(fl);
-      return 0;
+   int i, id;
+
+   lbs->el_index[index].thread_head = head;
+   for (id = lbs->el_index[index].first_reply; id; id = lbs->el_index[i].next_reply) {
+      i = el_find_index(lbs, id);
+      if (i < 0)
+         break;
+
+      /* replies which have the head already also have it below, which stops loops */
+      if (lbs->el_index[i].thread_head != head)
+         el_thread_set_head(lbs, i, head);
    }
-   
-   if (*file_list == NULL)
-      *file_list = (char *)xmalloc(n_files*MAX_PATH_LENGTH);
-   else
-      *file_list = (char *)xrealloc(*file_list, ((*n)+n_files)*MAX_PATH_LENGTH);
-   
-   /* go through all files */
-   for (index = 0; index < n_files; index++) {
-      if (fnmatch1("??????a.log", &fl[index * MAX_PATH_LENGTH]) == 0) {
-         p = *file_list + ((*n) * MAX_PATH_LENGTH);
-         strlcpy(p, dir, MAX_PATH_LENGTH);
-         if (p[strlen(p)-1] != DIR_SEPARATOR)
-            strlcat(p, DIR_SEPARATOR_STR, MAX_PATH_LENGTH);
-         strlcat(p, fl + index * MAX_PATH_LENGTH, MAX_PATH_LENGTH);
-         (*n)++;
+}
+
+void el_thread_rebuild(LOGBOOK * lbs)
+/* set reply lists and thread heads of all entries after the index has been built */
+{
+   EL_INDEX *eli;
+   int i, j, n;
+
+   eli = lbs->el_index;
+   n = *lbs->n_el_index;
+   for (i = 0; i < n; i++)
+      eli[i].thread_head = eli[i].first_reply = eli[i].next_reply = 0;
+
+   /* prepend replies from the end, so that the lists are in index order */
+   for (i = n - 1; i >= 0; i--) {
+      if (eli[i].in_reply_to == 0 || el_find_index(lbs, eli[i].message_id) != i)
+         continue;
+      j = el_find_index(lbs, eli[i].in_reply_to);
+      if (j >= 0 && j != i) {
+         eli[i].next_reply = eli[j].first_reply;
+         eli[j].first_reply = eli[i].message_id;
+      }
+   }
+
+   /* start at entries which are no reply or whose original is missing */
+   for (i = 0; i < n; i++) {
+      if (eli[i].in_reply_to == 0)
+         el_thread_set_head(lbs, i, eli[i].message_id);
+      else if (el_find_index(lbs, eli[i].in_reply_to) < 0)
+         el_thread_set_head(lbs, i, eli[i].in_reply_to);
+   }
+
+   /* entries in reply loops never reach a head */
+   for (i = 0; i < n; i++)
+      if (eli[i].thread_head == 0)
+         eli[i].thread_head = eli[i].message_id;
+}
+
+void el_thread_link(LOGBOOK * lbs, int index, BOOL adopt)
+/* add a new entry or an entry with changed in_reply_to to its thread, with adopt
+   replies to its ID whose original was missing so far become its replies */
+{
+   EL_INDEX *eli;
+   int i, j, id, head;
+
+   eli = lbs->el_index;
+   eli[index].next_reply = 0;
+
+   if (adopt) {
+      eli[index].first_reply = 0;
+      for (i = *lbs->n_el_index - 1; i >= 0; i--)
+         if (eli[i].in_reply_to == eli[index].message_id && i != index &&
+             el_find_index(lbs, eli[i].message_id) == i) {
+            eli[i].next_reply = eli[index].first_reply;
+            eli[index].first_reply = eli[i].message_id;
+         }
+   }
+
+   head = eli[index].message_id;
+   if (eli[index].in_reply_to) {
+      head = eli[index].in_reply_to;
+      j = el_find_index(lbs, eli[index].in_reply_to);
+      if (j >= 0 && j != index && el_find_index(lbs, eli[index].message_id) == index) {
+         head = eli[j].thread_head;
+
+         /* append to replies of original */
+         id = eli[index].message_id;
+         if (eli[j].first_reply == 0)
+            eli[j].first_reply = id;
+         else {
+            for (i = el_find_index(lbs, eli[j].first_reply); i >= 0 && eli[i].next_reply;
+                 i = el_find_index(lbs, eli[i].next_reply));
+            if (i >= 0)
+               eli[i].next_reply = id;
+         }
+      }
+   }
+
+   el_thread_set_head(lbs, index, head);
+}
+
+void el_thread_unlink(LOGBOOK * lbs, int index)
+/* remove an entry from the replies of its original */
+{
+   EL_INDEX *eli;
+   int i, j, prev;
+
+   eli = lbs->el_index;
+   j = el_find_index(lbs, eli[index].in_reply_to);
+   if (j < 0)
+      return;
+
+   for (prev = -1, i = el_find_index(lbs, eli[j].first_reply); i >= 0 && i != index;
+        prev = i, i = el_find_index(lbs, eli[i].next_reply));
+   if (i != index)
+      return;
+
+   if (prev < 0)
+      eli[j].first_reply = eli[index].next_reply;
+   else
+      eli[prev].next_reply = eli[index].next_reply;
+   eli[index].next_reply = 0;
+}
+
+void el_thread_delete(LOGBOOK * lbs, int index)
+/* take an entry out of its thread before it is removed from the index, its replies
+   get its ID as thread head since their original is missing from now on */
+{
+   EL_INDEX *eli;
+   int i, id;
+
+   eli = lbs->el_index;
+   el_thread_unlink(lbs, index);
+
+   for (id = eli[index].first_reply; id; id = eli[i].next_reply) {
+      i = el_find_index(lbs, id);
+      if (i < 0)
+         break;
+      el_thread_set_head(lbs, i, eli[index].message_id);
+   }
+
+   /* unchain the replies, they get new lists when the original comes back */
+   while (eli[index].first_reply) {
+      i = el_find_index(lbs, eli[index].first_reply);
+      if (i < 0)
+         break;
+      eli[index].first_reply = eli[i].next_reply;
+      eli[i].next_reply = 0;
+   }
+   eli[index].first_reply = 0;
+}
+
+/* Index entries refer to their ??????a.log file through a position in a file
+   table shared by all logbooks using the same index, so that the paths are
+   stored once per file instead of once per entry. Files are never removed
+   from the table, which gets cleared when the index is rebuilt. */
+
+static int el_file_append(EL_FILE_TABLE * table, char *subdir, char *name)
+{
+   if (table->n == table->size) {
+      table->size = table->size ? table->size * 2 : 64;
+      table->file = xrealloc(table->file, sizeof(EL_FILE) * table->size);
+   }
+
+   memset(&table->file[table->n], 0, sizeof(EL_FILE));
+   strlcpy(table->file[table->n].subdir, subdir, sizeof(table->file[table->n].subdir));
+   strlcpy(table->file[table->n].file_name, name, sizeof(table->file[table->n].file_name));
+
+   return table->n++;
+}
+
+int el_file_id(LOGBOOK * lbs, char *file_name, BOOL is_new)
+/* return position of a file given by its full path in the file table, adding it
+   if necessary; the search can be skipped if the file is known not to be in the table */
+{
+   char subdir[256], name[256], *p;
+   EL_FILE_TABLE *table;
+   int i;
+
+   /* split path relative to data directory into subdirectory and file name */
+   if (strncmp(file_name, lbs->data_dir, strlen(lbs->data_dir)) == 0)
+      file_name += strlen(lbs->data_dir);
+   strlcpy(subdir, file_name, sizeof(subdir));
+   p = strrchr(subdir, DIR_SEPARATOR);
+   if (p) {
+      strlcpy(name, p + 1, sizeof(name));
+      *(p + 1) = 0;
+   } else {
+      strlcpy(name, subdir, sizeof(name));
+      subdir[0] = 0;
+   }
+
+   /* recent files are at the end */
+   table = lbs->el_files;
+   if (!is_new)
+      for (i = table->n - 1; i >= 0; i--)
+         if (strcmp(table->file[i].file_name, name) == 0 && strcmp(table->file[i].subdir, subdir) == 0)
+            return i;
+
+   return el_file_append(table, subdir, name);
+}
+
+EL_FILE *el_file(LOGBOOK * lbs, int index)
+/* return file record of an index entry */
+{
+   return &lbs->el_files->file[lbs->el_index[index].file_id];
+}
+
+/*------------------------------------------------------------------*/
+
+/* The attribute values of all entries are kept in an attribute table shared
+   by the logbooks using the same index, so that list pages filtering or
+   sorting by attributes do not have to read every entry. The table has one
+   column per attribute name found in the entries and one row per entry,
+   addressed by EL_INDEX.attr_row, so rows stay in place when the index gets
+   sorted. Each column stores its distinct values once and the rows refer to
+   them by code. Rows of deleted entries are dropped on the next rebuild. */
+
+static unsigned int el_attr_hash_key(char *value, int size)
+{
+   unsigned int h;
+
+   for (h = 2166136261U; *value; value++)
+      h = (h ^ (unsigned char) *value) * 16777619U;
+
+   return h & (size - 1);
+}
+
+static int el_attr_code(EL_ATTR_COLUMN * c, char *value)
+/* return code of a value, adding it to the values of the column if necessary */
+{
+   unsigned int h;
+   int i;
+
+   if (!*value)
+      return 0;
+
+   if (2 * (c->n_values + 1) > c->hash_size) {
+      xfree(c->hash);
+      c->hash_size = c->hash_size ? c->hash_size * 2 : 64;
+      c->hash = xcalloc(c->hash_size, sizeof(int));
+      for (i = 1; i < c->n_values; i++) {
+         for (h = el_attr_hash_key(c->value[i], c->hash_size); c->hash[h]; h = (h + 1) & (c->hash_size - 1));
+         c->hash[h] = i + 1;
+      }
+   }
+
+   for (h = el_attr_hash_key(value, c->hash_size); c->hash[h]; h = (h + 1) & (c->hash_size - 1))
+      if (strcmp(c->value[c->hash[h] - 1], value) == 0)
+         return c->hash[h] - 1;
+
+   if (c->n_values == c->size_values) {
+      c->size_values *= 2;
+      c->value = xrealloc(c->value, sizeof(char *) * c->size_values);
+   }
+   c->value[c->n_values] = xstrdup(value);
+   c->hash[h] = c->n_values + 1;
+
+   return c->n_values++;
+}
+
+static int el_attr_column(EL_ATTR_TABLE * t, char *name, int len)
+/* return column of the attribute with a name of given length, adding it if necessary */
+{
+   EL_ATTR_COLUMN *c;
+   int i;
+
+   for (i = 0; i < t->n_columns; i++)
+      if (strncmp(t->column[i].name, name, len) == 0 && t->column[i].name[len] == 0)
+         return i;
+
+   t->column = xrealloc(t->column, sizeof(EL_ATTR_COLUMN) * (t->n_columns + 1));
+   c = &t->column[t->n_columns];
+   memset(c, 0, sizeof(EL_ATTR_COLUMN));
+   c->name = xmalloc(len + 1);
+   memcpy(c->name, name, len);
+   c->name[len] = 0;
+   c->size_values = 16;
+   c->value = xmalloc(sizeof(char *) * c->size_values);
+   c->value[0] = xstrdup("");
+   c->n_values = 1;
+   c->code = xcalloc(t->size_rows + 1, sizeof(int));
+
+   return t->n_columns++;
+}
+
+int el_attr_new_row(EL_ATTR_TABLE * t)
+/* add an empty row to the attribute table */
+{
+   int i, size;
+
+   if (t->n_rows == t->size_rows) {
+      size = t->size_rows ? t->size_rows * 2 : 1024;
+      for (i = 0; i < t->n_columns; i++) {
+         t->column[i].code = xrealloc(t->column[i].code, sizeof(int) * size);
+         memset(t->column[i].code + t->size_rows, 0, sizeof(int) * (size - t->size_rows));
+      }
+      t->size_rows = size;
+   }
+
+   return t->n_rows++;
+}
+
+int el_header_size(char *message)
+/* return size of entry header up to the separator line as found by el_decode(), or -1 */
+{
+   char *ph;
+
+   for (ph = strstr(message, "========================================"); ph;
+        ph = strstr(ph + 40, "========================================"))
+      if (ph[40] == '\r' || ph[40] == '\n')
+         return ph - message;
+
+   return -1;
+}
+
+void el_attr_encode(EL_ATTR_TABLE * t, int row, char *header, int size)
+/* store the "name: value" lines of an entry header in a row, the first line of a name
+   wins as in el_decode() */
+{
+   char value[10000], *pc, *pe, *p;
+   int i, n_seen, column, seen[256];
+
+   for (i = 0; i < t->n_columns; i++)
+      t->column[i].code[row] = 0;
+
+   n_seen = 0;
+   for (pc = header; pc < header + size;) {
+      for (pe = pc; pe < header + size && *pe != '\n' && *pe != '\r'; pe++);
+
+      for (p = pc; p + 1 < pe && (p[0] != ':' || p[1] != ' '); p++);
+      if (p + 1 < pe) {
+         column = el_attr_column(t, pc, p - pc);
+         for (i = 0; i < n_seen; i++)
+            if (seen[i] == column)
+               break;
+
+         if (i == n_seen && n_seen < 256) {
+            seen[n_seen++] = column;
+            i = pe - (p + 2);
+            if (i > (int) sizeof(value) - 1)
+               i = sizeof(value) - 1;
+            memcpy(value, p + 2, i);
+            value[i] = 0;
+            t->column[column].code[row] = el_attr_code(&t->column[column], value);
+         }
+      }
+
+      for (pc = pe; pc < header + size && (*pc == '\n' || *pc == '\r'); pc++);
+   }
+}
+
+void el_attr_free(EL_ATTR_TABLE * t)
+/* free all columns and trigram lists of an attribute table */
+{
+   int i, j;
+
+   for (i = 0; i < t->n_columns; i++) {
+      for (j = 0; j < t->column[i].n_values; j++)
+         xfree(t->column[i].value[j]);
+      xfree(t->column[i].value);
+      xfree(t->column[i].hash);
+      xfree(t->column[i].code);
+      xfree(t->column[i].name);
+   }
+   xfree(t->column);
+
+   if (t->text) {
+      for (i = 0; i < EL_TEXT_BUCKETS; i++)
+         xfree(t->text[i].data);
+      xfree(t->text);
+   }
+   memset(t, 0, sizeof(EL_ATTR_TABLE));
+}
+
+void el_attr_columns(LOGBOOK * lbs, char attr_list[MAX_N_ATTR][NAME_LENGTH], int n_attr, int *column)
+/* find columns of attributes in attr_list, column[n_attr] becomes the column of the entry date */
+{
+   EL_ATTR_TABLE *t;
+   int i, j;
+
+   t = lbs->el_attr;
+   for (i = 0; i <= n_attr; i++) {
+      column[i] = -1;
+      for (j = 0; t && j < t->n_columns; j++)
+         if (strcmp(t->column[j].name, i < n_attr ? attr_list[i] : "Date") == 0) {
+            column[i] = j;
+            break;
+         }
+   }
+}
+
+BOOL el_attr_retrieve(LOGBOOK * lbs, int index, int *column, int n_attr, char attrib[MAX_N_ATTR][NAME_LENGTH],
+                      char *date)
+/* get attributes and date of an entry from the attribute table like el_retrieve(), with column
+   from el_attr_columns(), return FALSE if the entry is not in the table */
+{
+   EL_ATTR_TABLE *t;
+   int i, row;
+
+   t = lbs->el_attr;
+   row = lbs->el_index[index].attr_row;
+   if (t == NULL || row < 0 || row >= t->n_rows)
+      return FALSE;
+
+   for (i = 0; i < n_attr; i++)
+      strlcpy(attrib[i], column[i] < 0 ? "" : t->column[column[i]].value[t->column[column[i]].code[row]],
+              NAME_LENGTH);
+
+   if (date)
+      strlcpy(date, column[n_attr] < 0 ? "" :
+              t->column[column[n_attr]].value[t->column[column[n_attr]].code[row]], 80);
+
+   return TRUE;
+}
+
+static char *el_attr_value(EL_ATTR_TABLE * t, int row, char *name)
+/* return value of a header line in a row, "" if the entry has no such line */
+{
+   int i;
+
+   for (i = 0; i < t->n_columns; i++)
+      if (strcmp(t->column[i].name, name) == 0)
+         return t->column[i].value[t->column[i].code[row]];
+
+   return "";
+}
+
+BOOL el_attr_links(LOGBOOK * lbs, int index, char *date, char *in_reply_to, char *reply_to, char *draft)
+/* get date, reply links and draft flag of an entry from the attribute table like el_retrieve(),
+   so that threads can be followed without reading the entries, return FALSE if the entry is
+   not in the table */
+{
+   EL_ATTR_TABLE *t;
+   int i, row;
+
+   t = lbs->el_attr;
+   if (index < 0 || index >= *lbs->n_el_index)
+      return FALSE;
+   row = lbs->el_index[index].attr_row;
+   if (t == NULL || row < 0 || row >= t->n_rows)
+      return FALSE;
+
+   if (date)
+      strlcpy(date, el_attr_value(t, row, "Date"), 80);
+
+   if (in_reply_to) {
+      strlcpy(in_reply_to, el_attr_value(t, row, "In reply to"), 80);
+      if (in_reply_to[0])
+         sprintf(in_reply_to, "%d", atoi(in_reply_to));
+   }
+
+   if (reply_to) {
+      strlcpy(reply_to, el_attr_value(t, row, "Reply to"), MAX_REPLY_TO * 10);
+      for (i = 0; reply_to[i]; i++)
+         if (!isdigit(reply_to[i]) && reply_to[i] != ' ' && reply_to[i] != ',')
+            reply_to[i] = ' ';
+   }
+
+   if (draft)
+      strlcpy(draft, el_attr_value(t, row, "Draft"), 80);
+
+   return TRUE;
+}
+
+/*------------------------------------------------------------------*/
+
+/* With the attribute table comes a trigram index for subtext searches.
+   Every trigram of an entry record is folded to lower case and hashed into
+   one of EL_TEXT_BUCKETS buckets, and each bucket keeps a list of the rows
+   of the entries with a trigram in it. The literal parts of a search
+   pattern then give buckets every matching entry has to be in, so that only
+   the entries found in all of them are read and matched with regexec().
+   Lists also contain rows of other trigrams in the same bucket, and an
+   edited entry keeps the trigrams of its old version in its row, which just
+   makes them candidates. */
+
+#define EL_TEXT_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+BOOL el_text_index_enabled()
+{
+   char str[80];
+
+   if (getcfg("global", "Text index", str, sizeof(str)))
+      return atoi(str) != 0;
+
+   return TRUE;
+}
+
+void el_text_init(EL_ATTR_TABLE * t)
+/* create empty trigram lists of an attribute table if the text index is enabled */
+{
+   if (el_text_index_enabled())
+      t->text = xcalloc(EL_TEXT_BUCKETS, sizeof(EL_TEXT_LIST));
+}
+
+static int el_text_bucket(unsigned char *p)
+/* return bucket of the trigram at p */
+{
+   unsigned int v;
+
+   v = (EL_TEXT_FOLD(p[0]) << 16) | (EL_TEXT_FOLD(p[1]) << 8) | EL_TEXT_FOLD(p[2]);
+
+   /* upper 14 bits of multiplicative hash for EL_TEXT_BUCKETS */
+   return (v * 2654435761U) >> 18;
+}
+
+int el_text_trigrams(char *text, int len, unsigned short *bucket, unsigned char *seen)
+/* collect distinct buckets of the trigrams in text, bucket must hold EL_TEXT_BUCKETS
+   values, seen is a cleared bitmap of EL_TEXT_BUCKETS bits which is cleared again */
+{
+   int i, b, n;
+
+   for (i = n = 0; i + 2 < len; i++) {
+      b = el_text_bucket((unsigned char *) text + i);
+      if ((seen[b >> 3] & (1 << (b & 7))) == 0) {
+         seen[b >> 3] |= 1 << (b & 7);
+         bucket[n++] = b;
+      }
+   }
+
+   for (i = 0; i < n; i++)
+      seen[bucket[i] >> 3] = 0;
+
+   return n;
+}
+
+static int el_text_put(unsigned char *p, int d)
+/* encode a row difference with seven bits per byte, return number of bytes */
+{
+   int n;
+
+   for (n = 0; d >= 128; d >>= 7)
+      p[n++] = (d & 127) | 128;
+   p[n++] = d;
+
+   return n;
+}
+
+static int el_text_delta(unsigned char **p)
+/* decode next row difference of a list */
+{
+   int d, s;
+
+   for (d = s = 0; **p & 128; s += 7)
+      d |= (*(*p)++ & 127) << s;
+   d |= *(*p)++ << s;
+
+   return d;
+}
+
+static void el_text_insert(EL_TEXT_LIST * l, int row)
+/* insert a row before the end of a list, used when an edited entry keeps its row */
+{
+   unsigned char *p, enc[10];
+   int r, prev, start, end, n;
+
+   /* find first row not below the new one */
+   for (p = l->data, r = prev = start = 0; p < l->data + l->size;) {
+      start = p - l->data;
+      r += el_text_delta(&p);
+      if (r >= row)
+         break;
+      prev = r;
+   }
+   if (r == row)
+      return;
+
+   /* replace difference to the next row by the ones to and from the new row */
+   end = p - l->data;
+   n = el_text_put(enc, row - prev);
+   n += el_text_put(enc + n, r - row);
+   if (l->size + n - (end - start) > l->alloc) {
+      l->alloc = 2 * (l->size + n);
+      l->data = xrealloc(l->data, l->alloc);
+   }
+   memmove(l->data + start + n, l->data + end, l->size - end);
+   memcpy(l->data + start, enc, n);
+   l->size += n - (end - start);
+}
+
+void el_text_add(EL_ATTR_TABLE * t, int row, unsigned short *bucket, int n)
+/* add a row to the lists of some buckets, rows are normally added in increasing order */
+{
+   EL_TEXT_LIST *l;
+   int i;
+
+   if (t->text == NULL)
+      return;
+
+   for (i = 0; i < n; i++) {
+      l = &t->text[bucket[i]];
+      if (l->size > 0 && row <= l->last) {
+         el_text_insert(l, row);
+         continue;
+      }
+
+      if (l->size + 5 > l->alloc) {
+         l->alloc = l->alloc ? l->alloc * 2 : 16;
+         l->data = xrealloc(l->data, l->alloc);
+      }
+
+      /* difference to previous row */
+      l->size += el_text_put(l->data + l->size, row - l->last);
+      l->last = row;
+   }
+}
+
+void el_text_encode(EL_ATTR_TABLE * t, int row, char *text, int len)
+/* add trigrams of text to the index under the given row */
+{
+   unsigned short *bucket;
+   unsigned char *seen;
+   int n;
+
+   if (t->text == NULL)
+      return;
+
+   bucket = xmalloc(sizeof(unsigned short) * EL_TEXT_BUCKETS);
+   seen = xcalloc(EL_TEXT_BUCKETS / 8, 1);
+   n = el_text_trigrams(text, len, bucket, seen);
+   el_text_add(t, row, bucket, n);
+   xfree(seen);
+   xfree(bucket);
+}
+
+static void el_text_rows(EL_TEXT_LIST * l, unsigned char *rows)
+/* set bits of the rows in a list */
+{
+   unsigned char *p;
+   int r;
+
+   for (p = l->data, r = 0; p < l->data + l->size;) {
+      r += el_text_delta(&p);
+      rows[r >> 3] |= 1 << (r & 7);
+   }
+}
+
+static void el_text_run(char *run, int len, unsigned short *bucket, int *n, unsigned char *seen)
+/* add buckets of the trigrams of a literal run of a pattern */
+{
+   int i, b;
+
+   for (i = 0; i + 2 < len; i++) {
+      b = el_text_bucket((unsigned char *) run + i);
+      if ((seen[b >> 3] & (1 << (b & 7))) == 0) {
+         seen[b >> 3] |= 1 << (b & 7);
+         bucket[(*n)++] = b;
+      }
+   }
+}
+
+int el_text_pattern(char *pattern, BOOL icase, unsigned short *bucket)
+/* collect buckets of the trigrams every match of an extended regular expression
+   contains, bucket must hold EL_TEXT_BUCKETS values, return zero if there are none */
+{
+   unsigned char seen[EL_TEXT_BUCKETS / 8];
+   char *run, *p, c, delim;
+   int n, len;
+
+   memset(seen, 0, sizeof(seen));
+   run = xmalloc(strlen(pattern) + 1);
+   n = len = 0;
+
+   for (p = pattern; *p;) {
+      c = *p++;
+
+      /* with alternatives or groups nothing is required for sure */
+      if (c == '|' || c == '(' || c == ')') {
+         n = len = 0;
+         break;
+      }
+
+      if (c == '[') {
+         /* skip bracket expression */
+         if (*p == '^')
+            p++;
+         if (*p == ']')
+            p++;
+         while (*p && *p != ']') {
+            if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+               for (delim = p[1], p += 2; *p && (p[0] != delim || p[1] != ']'); p++);
+               if (*p)
+                  p++;
+            }
+            if (*p)
+               p++;
+         }
+         if (*p)
+            p++;
+         c = 0;
+      } else if (c == '*' || c == '?' || c == '{') {
+         /* previous character is optional */
+         if (len > 0)
+            len--;
+         if (c == '{')
+            while (*p && *p++ != '}');
+         c = 0;
+      } else if (c == '+' || c == '.' || c == '^' || c == '$')
+         c = 0;
+      else if (c == '\\') {
+         /* escaped punctuation is literal, others are classes, anchors or back references */
+         c = *p;
+         if (c)
+            p++;
+         if (isalnum((unsigned char) c) || strchr("<>`'", c))
+            c = 0;
+      }
+
+      /* case folding of non-ASCII characters and of letters which have non-ASCII
+         variants in some locales cannot be reproduced by the index */
+      if (icase && c && ((c & 0x80) || strchr("iksIKS", c)))
+         c = 0;
+
+      if (c)
+         run[len++] = c;
+      else {
+         el_text_run(run, len, bucket, &n, seen);
+         len = 0;
+      }
+   }
+
+   el_text_run(run, len, bucket, &n, seen);
+   xfree(run);
+
+   return n;
+}
+
+int *el_text_invert(EL_ATTR_TABLE * t, unsigned short **bucket)
+/* list the buckets of every row, buckets of row r are (*bucket)[first[r]] up to
+   (*bucket)[first[r + 1] - 1] where first is returned, both have to be freed */
+{
+   unsigned char *p;
+   int i, r, *first, *pos;
+
+   first = xcalloc(t->n_rows + 1, sizeof(int));
+   for (i = 0; i < EL_TEXT_BUCKETS; i++)
+      for (p = t->text[i].data, r = 0; p < t->text[i].data + t->text[i].size;) {
+         r += el_text_delta(&p);
+         first[r + 1]++;
+      }
+
+   for (r = 0; r < t->n_rows; r++)
+      first[r + 1] += first[r];
+
+   *bucket = xmalloc(sizeof(unsigned short) * (first[t->n_rows] + 1));
+   pos = xmalloc(sizeof(int) * (t->n_rows + 1));
+   memcpy(pos, first, sizeof(int) * (t->n_rows + 1));
+   for (i = 0; i < EL_TEXT_BUCKETS; i++)
+      for (p = t->text[i].data, r = 0; p < t->text[i].data + t->text[i].size;) {
+         r += el_text_delta(&p);
+         (*bucket)[pos[r]++] = i;
+      }
+   xfree(pos);
+
+   return first;
+}
+
+unsigned char *el_text_candidates(EL_ATTR_TABLE * t, unsigned short *bucket, int n)
+/* return bitmap of the rows found in all given buckets, NULL if the table has no text index */
+{
+   unsigned char *rows, *tmp;
+   int i, j, k, size;
+
+   if (t == NULL || t->text == NULL || n == 0)
+      return NULL;
+
+   size = t->n_rows / 8 + 1;
+   rows = xcalloc(size, 1);
+
+   /* start with the shortest list */
+   for (i = j = 0; i < n; i++)
+      if (t->text[bucket[i]].size < t->text[bucket[j]].size)
+         j = i;
+   el_text_rows(&t->text[bucket[j]], rows);
+
+   tmp = xmalloc(size);
+   for (i = 0; i < n; i++) {
+      if (i == j)
+         continue;
+      memset(tmp, 0, size);
+      el_text_rows(&t->text[bucket[i]], tmp);
+      for (k = 0; k < size; k++)
+         rows[k] &= tmp[k];
+   }
+   xfree(tmp);
+
+   return rows;
+}
+
+/*------------------------------------------------------------------*/
+
+void el_share_index(LOGBOOK * lbs)
+/* if other logbooks have the same index, update their pointers after a realloc */
+{
+   int i;
+
+   if (lb_list == NULL)
+      return;
+
+   for (i = 0; lb_list[i].name[0]; i++)
+      if (&lb_list[i] != lbs && lb_list[i].n_el_index == lbs->n_el_index)
+         lb_list[i].el_index = lbs->el_index;
+}
+
+int el_index_capacity(int n)
+/* number of entries allocated for an index of n entries, growing in powers of two */
+{
+   int size;
+
+   for (size = 16; size < n; size *= 2);
+   return size;
+}
+
+void el_index_resize(LOGBOOK * lbs, int n)
+/* set the number of index entries, reallocating only if the capacity changes */
+{
+   if (el_index_capacity(n) != el_index_capacity(*lbs->n_el_index))
+      lbs->el_index = xrealloc(lbs->el_index, sizeof(EL_INDEX) * el_index_capacity(n));
+   *lbs->n_el_index = n;
+}
+
+void el_free_index(LOGBOOK * list)
+/* free index of all logbooks in list, taking care of logbooks sharing an index */
+{
+   int i, j;
+
+   for (i = 0; list[i].name[0]; i++) {
+      if (list[i].n_el_index == NULL)
+         continue;
+
+      xfree(list[i].el_index);
+      xfree(list[i].n_el_index);
+      if (list[i].id_hash) {
+         xfree(list[i].id_hash->slot);
+         xfree(list[i].id_hash);
+      }
+      if (list[i].el_files) {
+         xfree(list[i].el_files->file);
+         xfree(list[i].el_files);
+      }
+      if (list[i].el_attr) {
+         el_attr_free(list[i].el_attr);
+         xfree(list[i].el_attr);
+      }
+
+      /* mark logbooks using the same index as freed */
+      for (j = i + 1; list[j].name[0]; j++)
+         if (list[j].n_el_index == list[i].n_el_index) {
+            list[j].el_index = NULL;
+            list[j].n_el_index = NULL;
+            list[j].id_hash = NULL;
+            list[j].el_files = NULL;
+            list[j].el_attr = NULL;
+         }
+
+      list[i].el_index = NULL;
+      list[i].n_el_index = NULL;
+      list[i].id_hash = NULL;
+      list[i].el_files = NULL;
+      list[i].el_attr = NULL;
+   }
+}
+
+/*------------------------------------------------------------------*/
+
+void generate_subdir_name(char *file_name, char *subdir, int size)
+{
+   char fn[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
+   int year;
+   
+   // extract path from file_name
+   strlcpy(path, file_name, size);
+   if (strrchr(path, DIR_SEPARATOR))
+      *(strrchr(path, DIR_SEPARATOR)+1) = 0;
+   
+   // extract file name
+   if (strrchr(file_name, DIR_SEPARATOR))
+      strlcpy(fn, strrchr(file_name, DIR_SEPARATOR)+1, sizeof(fn));
+   else
+      strlcpy(fn, file_name, sizeof(fn));
+   
+   // create subdir from name
+   year = (fn[0]-'0')*10+(fn[1]-'0');
+   // month = (fn[2]-'0')*10+(fn[3]-'0');
+   if (year < 80)
+      sprintf(subdir, "20%02d", year);
+   else
+      sprintf(subdir, "19%02d", year);
+   
+   strlcat(subdir, DIR_SEPARATOR_STR, size);
+}
+
+/*------------------------------------------------------------------*/
+
+int restructure_dir(char *dir)
+{
+   char *file_list;
+   int n1, n2, index, status;
+   char old_path[MAX_PATH_LENGTH], new_path[MAX_PATH_LENGTH],
+   subdir[MAX_PATH_LENGTH];
+   static int first = TRUE;
+   
+   /* go through all entry files */
+   n1 = ss_file_find(dir, "??????a.log", &file_list);
+   for (index = 0; index < n1; index++) {
+      generate_subdir_name(file_list + index * MAX_PATH_LENGTH, subdir, sizeof(subdir));
+
+      // create new subdir
+      strlcpy(new_path, dir, MAX_PATH_LENGTH);
+      strlcat(new_path, subdir, MAX_PATH_LENGTH);
+      
+#ifdef OS_WINNT
+      status = mkdir(new_path);
+#else
+      status = mkdir(new_path, 0755);
+#endif
+      
+      if (status == 0) {
+         if (first) {
+            eprintf("\nFound old directory structure. Creating subdirectories and moving files...\n");
+            first = FALSE;
+         }
+         eprintf("Created directory \"%s\"\n", new_path);
+      } else {
+         if (errno != EEXIST) {
+            eprintf("generate_subdir_name: %s\n", strerror(errno));
+            eprintf("Cannot create directory \"%s\"\n", new_path);
+         }
+      }
+      
+      strlcpy(old_path, dir, sizeof(old_path));
+      strlcat(old_path, file_list + index * MAX_PATH_LENGTH, sizeof(old_path));
+      strlcpy(new_path, dir, sizeof(new_path));
+      strlcat(new_path, subdir, sizeof(new_path));
+      strlcat(new_path, file_list + index * MAX_PATH_LENGTH, sizeof(new_path));
+      
+      rename(old_path, new_path);
+   }
+   if (file_list)
+      xfree(file_list);
+   
+   /* go through all attachment files */
+   n2 = ss_file_find(dir, "??????_??????_*", &file_list);
+   for (index = 0; index < n2; index++) {
+      generate_subdir_name(file_list + index * MAX_PATH_LENGTH, subdir, sizeof(subdir));
+
+      // create new subdir
+      strlcpy(new_path, dir, MAX_PATH_LENGTH);
+      strlcat(new_path, subdir, MAX_PATH_LENGTH);
+      
+#ifdef OS_WINNT
+      status = mkdir(new_path);
+#else
+      status = mkdir(new_path, 0755);
+#endif
+      
+      strlcpy(old_path, dir, sizeof(old_path));
+      strlcat(old_path, file_list + index * MAX_PATH_LENGTH, sizeof(old_path));
+      strlcpy(new_path, dir, sizeof(new_path));
+      strlcat(new_path, subdir, sizeof(new_path));
+      strlcat(new_path, file_list + index * MAX_PATH_LENGTH, sizeof(new_path));
+      
+      rename(old_path, new_path);
+   }
+   if (file_list)
+      xfree(file_list);
+
+   return n1+n2;
+}
+
+/*------------------------------------------------------------------*/
+
+/* The contents of logbook files are kept in a small LRU cache, so that
+   retrieving an entry does not have to read the file again. The files are
+   read into memory instead of being mapped, since accessing a mapping of a
+   file truncated meanwhile, by an external edit or from another process,
+   would raise SIGBUS. A buffer is always followed by a zero byte, so it
+   can be used as a string. */
+
+#define N_FILE_CACHE      128
+#define FILE_CACHE_BYTES  (64*1024*1024)        /* files cached at most */
+
+typedef struct {
+   char file_name[MAX_PATH_LENGTH];
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   time_t mtime;
+   char *data;
+   unsigned int last_used;
+} EL_FILE_CACHE;
+
+EL_FILE_CACHE el_file_cache[N_FILE_CACHE];
+unsigned int el_file_cache_clock = 0;
+int el_file_cache_bytes = 0;
+
+char *el_read_file(int fh, int size)
+/* read a whole file, return NULL on error */
+{
+   char *p;
+
+   p = xmalloc(size + 1);
+   lseek(fh, 0, SEEK_SET);
+   if (my_read(fh, p, size) != size) {
+      xfree(p);
+      return NULL;
+   }
+   p[size] = 0;
+
+   return p;
+}
+
+static void el_file_cache_free(EL_FILE_CACHE * m)
+{
+   xfree(m->data);
+   el_file_cache_bytes -= (int) m->size;
+   m->data = NULL;
+}
+
+void el_file_cache_drop(char *file_name)
+/* remove a file from the cache, has to be called after a file has been modified */
+{
+   int i;
+
+   for (i = 0; i < N_FILE_CACHE; i++)
+      if (el_file_cache[i].data && strcmp(el_file_cache[i].file_name, file_name) == 0)
+         el_file_cache_free(&el_file_cache[i]);
+}
+
+char *el_file_cache_get(char *file_name, int *size)
+/* return contents of a logbook file from the cache, valid until the next call */
+{
+   struct stat st;
+   EL_FILE_CACHE *m, *mo;
+   int i, fh;
+
+   el_file_cache_clock++;
+
+   for (i = 0; i < N_FILE_CACHE; i++)
+      if (el_file_cache[i].data && strcmp(el_file_cache[i].file_name, file_name) == 0)
+         break;
+
+   if (i < N_FILE_CACHE) {
+      m = &el_file_cache[i];
+
+      /* use cached contents only if file was not replaced or resized */
+      if (stat(file_name, &st) == 0 && m->dev == st.st_dev && m->ino == st.st_ino &&
+          m->size == st.st_size && m->mtime == st.st_mtime) {
+         m->last_used = el_file_cache_clock;
+         *size = (int) m->size;
+         return m->data;
+      }
+   } else {
+      /* take free or least recently used slot */
+      m = &el_file_cache[0];
+      for (i = 0; i < N_FILE_CACHE; i++) {
+         if (el_file_cache[i].data == NULL) {
+            m = &el_file_cache[i];
+            break;
+         }
+         if (el_file_cache[i].last_used < m->last_used)
+            m = &el_file_cache[i];
+      }
+   }
+
+   if (m->data)
+      el_file_cache_free(m);
+
+   fh = open(file_name, O_RDONLY | O_BINARY);
+   if (fh < 0)
+      return NULL;
+
+   if (fstat(fh, &st) < 0) {
+      close(fh);
+      return NULL;
+   }
+
+   /* make room by dropping least recently used files, the new one is kept in any case */
+   while (el_file_cache_bytes > 0 && el_file_cache_bytes + st.st_size > FILE_CACHE_BYTES) {
+      for (i = 0, mo = NULL; i < N_FILE_CACHE; i++)
+         if (el_file_cache[i].data && (mo == NULL || el_file_cache[i].last_used < mo->last_used))
+            mo = &el_file_cache[i];
+      el_file_cache_free(mo);
+   }
+
+   m->data = el_read_file(fh, (int) st.st_size);
+   close(fh);
+   if (m->data == NULL)
+      return NULL;
+   el_file_cache_bytes += (int) st.st_size;
+
+   strlcpy(m->file_name, file_name, sizeof(m->file_name));
+   m->dev = st.st_dev;
+   m->ino = st.st_ino;
+   m->size = st.st_size;
+   m->mtime = st.st_mtime;
+   m->last_used = el_file_cache_clock;
+
+   *size = (int) m->size;
+   return m->data;
+}
+
+/*------------------------------------------------------------------*/
+
+/* With "Append only = 1", an edited entry is written as new version to the end
+   of its file and the old version is marked by replacing "$@MID@$:" with a
+   tombstone of the same length. Deleted entries get a tombstone as well, so
+   offsets of other entries in the file never change. The space of tombstoned
+   records is given back by el_compact_file() when the server is idle. */
+
+#define EL_TOMBSTONE "$@DEL@$:"
+
+BOOL el_append_only()
+{
+   char str[80];
+
+   if (getcfg("global", "Append only", str, sizeof(str)))
+      return atoi(str) != 0;
+
+   return FALSE;
+}
+
+char *el_next_record(char *p)
+/* return start of next entry or tombstone at or after p, NULL if there is none */
+{
+   for (p = strstr(p, "$@"); p; p = strstr(p + 2, "$@"))
+      if (strncmp(p, "$@MID@$:", 8) == 0 || strncmp(p, EL_TOMBSTONE, 8) == 0)
+         return p;
+
+   return NULL;
+}
+
+typedef struct EL_SNAP_FILE EL_SNAP_FILE;
+
+typedef struct {
+   LOGBOOK *lbs;
+   char *file_name;             /* full path of ??????a.log file */
+   int file_id;                 /* position of file in file table of logbook */
+   EL_SNAP_FILE *snap_file;     /* entries taken from snapshot, NULL if file has to be parsed */
+   EL_INDEX *el_index;          /* entries of parsed file */
+   int n_el_index;
+   char *headers;               /* headers of parsed entries, one string per entry */
+   int headers_size;
+   int headers_alloc;
+   unsigned short *trigrams;    /* number and buckets of trigrams per entry if text is indexed */
+   int trigrams_size;
+   int trigrams_alloc;
+   int dead_size;               /* size of tombstoned records */
+   int status;
+} EL_INDEX_TASK;
+
+int parse_file(EL_INDEX_TASK * task)
+/* parse a ??????a.log file and collect its entries, their headers and their trigrams
+   in the task, the size of tombstoned records is added to dead_size */
+{
+   char str[256], date[256], *buffer, *p, *pn, in_reply_to[80], *file_name;
+   unsigned char seen[EL_TEXT_BUCKETS / 8];
+   int length, i, fh, len, size;
+   BOOL text;
+   EL_INDEX *eli;
+   
+   file_name = task->file_name;
+   text = task->lbs->el_attr && task->lbs->el_attr->text;
+   memset(seen, 0, sizeof(seen));
+   fh = open(file_name, O_RDONLY | O_BINARY, 0644);
+   
+   if (fh < 0) {
+      sprintf(str, "Cannot open file \"%s\"", file_name);
+      eprintf("%s; %s\n", str, strerror(errno));
+      return EL_FILE_ERROR;
+   }
+   
+   /* read file, not through the cache since this might run in several threads */
+   length = lseek(fh, 0, SEEK_END);
+   
+   if (length <= 0)
+      close(fh);
+   else {
+      buffer = el_read_file(fh, length);
+      close(fh);
+      if (buffer == NULL) {
+         eprintf("Cannot read file \"%s\"\n", file_name);
+         return EL_FILE_ERROR;
+      }
+      
+      /* go through buffer */
+      p = buffer;
+      
+      do {
+         p = el_next_record(p);
+         
+         if (p && strncmp(p, EL_TOMBSTONE, 8) == 0) {
+            pn = el_next_record(p + 8);
+            task->dead_size += pn ? pn - p : (int) strlen(p);
+            p += 8;
+         } else if (p) {
+            if (task->el_index == NULL
+                || el_index_capacity(task->n_el_index + 1) != el_index_capacity(task->n_el_index))
+               task->el_index = xrealloc(task->el_index, sizeof(EL_INDEX) * el_index_capacity(task->n_el_index + 1));
+            if (task->el_index == NULL) {
+               eprintf("Not enough memory to allocate entry index\n");
+               return EL_MEM_ERROR;
+            }
+            eli = &task->el_index[task->n_el_index];
+            eli->file_id = task->file_id;
+            eli->attr_row = -1;
+            
+            el_decode(p, "Date: ", date, sizeof(date));
+            el_decode_int(p, "In reply to: ", in_reply_to, sizeof(in_reply_to));
+            
+            eli->file_time = date_to_ltime(date);
+            
+            eli->message_id = atoi(p + 8);
+            eli->offset = p - buffer;
+            eli->in_reply_to = atoi(in_reply_to);
+            
+            pn = el_next_record(p + 8);
+            if (pn)
+               len = pn - p;
+            else
+               len = strlen(p);
+            
+            MD5_checksum(p, len, eli->md5_digest);
+            
+            if (eli->message_id > 0) {
+               if (get_verbose() == VERBOSE_DEBUG) {
+                  eprintf("  ID %3d, %s, ofs %5d, %s, MD5=", eli->message_id,
+                          strrchr(file_name, DIR_SEPARATOR) ? strrchr(file_name, DIR_SEPARATOR) + 1 : file_name,
+                          eli->offset,
+                          eli->in_reply_to ? "reply" : "thead");
+                  
+                  for (i = 0; i < 16; i++)
+                     eprintf("%02X", eli->md5_digest[i]);
+                  eprintf("\n");
+               }
+               
+               /* keep header for the attribute table */
+               size = el_header_size(p);
+               if (size < 0 || size > len)
+                  size = 0;
+               if (task->headers_size + size + 1 > task->headers_alloc) {
+                  task->headers_alloc = 2 * (task->headers_size + size + 1);
+                  task->headers = xrealloc(task->headers, task->headers_alloc);
+               }
+               memcpy(task->headers + task->headers_size, p, size);
+               task->headers[task->headers_size + size] = 0;
+               task->headers_size += size + 1;
+
+               /* keep trigram buckets for the text index */
+               if (text) {
+                  size = len < EL_TEXT_BUCKETS ? len : EL_TEXT_BUCKETS;
+                  if (task->trigrams_size + size + 1 > task->trigrams_alloc) {
+                     task->trigrams_alloc = 2 * (task->trigrams_size + size + 1);
+                     task->trigrams = xrealloc(task->trigrams, sizeof(unsigned short) * task->trigrams_alloc);
+                  }
+                  task->trigrams[task->trigrams_size] =
+                      el_text_trigrams(p, len, task->trigrams + task->trigrams_size + 1, seen);
+                  task->trigrams_size += task->trigrams[task->trigrams_size] + 1;
+               }
+
+               /* valid ID */
+               task->n_el_index++;
+            }
+            
+            p += 8;
+         }
+         
+      } while (p);
+      
+      xfree(buffer);
+   }
+   
+   return SUCCESS;
+}
+
+/*------------------------------------------------------------------*/
+
+int scan_dir_tree(LOGBOOK *lbs, const char *dir, char **file_list, int *n)
+{
+   int  index, n_files;
+   char str[MAX_PATH_LENGTH];
+   char *fl, *p;
+   
+   fl = NULL;
+   n_files = ss_file_find(dir, "*", &fl);
+   if (n_files == 0) {
+      if (fl)
+         xfree(fl);
+      return 0;
+   }
+   
+   if (*file_list == NULL)
+      *file_list = (char *)xmalloc(n_files*MAX_PATH_LENGTH);
+   else
+      *file_list = (char *)xrealloc(*file_list, ((*n)+n_files)*MAX_PATH_LENGTH);
+   
+   /* go through all files */
+   for (index = 0; index < n_files; index++) {
+      if (fnmatch1("??????a.log", &fl[index * MAX_PATH_LENGTH]) == 0) {
+         p = *file_list + ((*n) * MAX_PATH_LENGTH);
+         strlcpy(p, dir, MAX_PATH_LENGTH);
+         if (p[strlen(p)-1] != DIR_SEPARATOR)
+            strlcat(p, DIR_SEPARATOR_STR, MAX_PATH_LENGTH);
+         strlcat(p, fl + index * MAX_PATH_LENGTH, MAX_PATH_LENGTH);
+         (*n)++;
       }
    }
    
@@ -4076,24 +5322,568 @@ int scan_dir_tree(LOGBOOK *lbs, const char *dir, char **file_list, int *n)
    return *n;
 }
 
-/*------------------------------------------------------------------*/
+/*------------------------------------------------------------------*/
+
+/* The index snapshot is a binary image of the entry index of a data
+   directory, stored as ELOG_INDEX_FILE in that directory. For every
+   ??????a.log file it contains the modification time and size the file
+   had when it was parsed, so that only files which changed since then
+   have to be parsed again on startup. The attribute lines and the trigram
+   buckets of all entries follow the entries, so that the attribute table
+   and the text index can be filled without reading the entries. */
+
+#define ELOG_INDEX_FILE    "elogd.idx"
+#define ELOG_INDEX_MAGIC   "ELOGIDX"
+#define ELOG_INDEX_VERSION 4
+
+typedef struct {
+   char magic[8];
+   int version;
+   int entry_size;
+   int n_files;
+   int n_entries;
+   int attr_size;               /* size of attribute lines of all entries */
+   int text_size;               /* number of trigram values, zero without text index */
+   long long scan_time;
+} EL_SNAP_HEADER;
+
+struct EL_SNAP_FILE {
+   char name[64];               /* path relative to data dir, like "2001/011108a.log" */
+   long long mtime;
+   long long size;
+   int first;
+   int n;
+   int dead_size;               /* size of tombstoned records */
+};
+
+typedef struct {
+   int message_id;
+   int offset;
+   int in_reply_to;
+   int attr_offset;             /* start of "name: value" lines in attribute section */
+   int text_offset;             /* number of trigram buckets in text section, followed by buckets */
+   long long file_time;
+   unsigned char md5_digest[16];
+} EL_SNAP_ENTRY;
+
+typedef struct {
+   EL_SNAP_HEADER header;
+   EL_SNAP_FILE *file;
+   EL_SNAP_ENTRY *entry;
+   char *attr;
+   unsigned short *text;
+   char *used;
+} EL_SNAPSHOT;
+
+BOOL el_snapshot_enabled()
+{
+   char str[80];
+
+   if (getcfg("global", "Index cache", str, sizeof(str)))
+      return atoi(str) != 0;
+
+   return TRUE;
+}
+
+int el_snap_file_compare(const void *f1, const void *f2)
+{
+   return strcmp(((EL_SNAP_FILE *) f1)->name, ((EL_SNAP_FILE *) f2)->name);
+}
+
+int eli_file_compare(const void *e1, const void *e2)
+{
+   int i;
+
+   i = ((EL_INDEX *) e1)->file_id - ((EL_INDEX *) e2)->file_id;
+   if (i == 0)
+      i = ((EL_INDEX *) e1)->offset - ((EL_INDEX *) e2)->offset;
+   return i;
+}
+
+void el_free_snapshot(EL_SNAPSHOT * snap)
+{
+   xfree(snap->file);
+   xfree(snap->entry);
+   xfree(snap->attr);
+   xfree(snap->text);
+   xfree(snap->used);
+   memset(snap, 0, sizeof(EL_SNAPSHOT));
+}
+
+BOOL el_load_snapshot(LOGBOOK * lbs, EL_SNAPSHOT * snap)
+/* read index snapshot of logbook data directory, return FALSE if not present or not valid */
+{
+   char file_name[MAX_PATH_LENGTH];
+   unsigned short *pt;
+   int i, j, fh, size;
+   long long total;
+   struct stat st;
+
+   memset(snap, 0, sizeof(EL_SNAPSHOT));
+
+   strlcpy(file_name, lbs->data_dir, sizeof(file_name));
+   strlcat(file_name, ELOG_INDEX_FILE, sizeof(file_name));
+   fh = open(file_name, O_RDONLY | O_BINARY);
+   if (fh < 0)
+      return FALSE;
+
+   /* the sections have to fill the file exactly, which also bounds the sizes allocated below */
+   total = -1;
+   if (fstat(fh, &st) == 0 &&
+       my_read(fh, &snap->header, sizeof(EL_SNAP_HEADER)) == sizeof(EL_SNAP_HEADER) &&
+       snap->header.n_files >= 0 && snap->header.n_entries >= 0 && snap->header.attr_size >= 1 &&
+       snap->header.text_size >= 0)
+      total = (long long) sizeof(EL_SNAP_HEADER) +
+          (long long) sizeof(EL_SNAP_FILE) * snap->header.n_files +
+          (long long) sizeof(EL_SNAP_ENTRY) * snap->header.n_entries +
+          (long long) snap->header.attr_size + (long long) sizeof(unsigned short) * snap->header.text_size;
+
+   if (total < 0 || total != (long long) st.st_size || total > INT_MAX ||
+       memcmp(snap->header.magic, ELOG_INDEX_MAGIC, sizeof(ELOG_INDEX_MAGIC)) != 0 ||
+       snap->header.version != ELOG_INDEX_VERSION ||
+       snap->header.entry_size != (int) sizeof(EL_SNAP_ENTRY)) {
+      close(fh);
+      el_free_snapshot(snap);
+      if (get_verbose() >= VERBOSE_INFO)
+         eprintf("Ignoring invalid index snapshot \"%s\"\n", file_name);
+      return FALSE;
+   }
+
+   /* snapshot without text index cannot be used with text index and vice versa */
+   if ((snap->header.text_size > 0) != (lbs->el_attr->text != NULL)) {
+      close(fh);
+      el_free_snapshot(snap);
+      return FALSE;
+   }
+
+   snap->file = xmalloc(sizeof(EL_SNAP_FILE) * snap->header.n_files);
+   snap->entry = xmalloc(sizeof(EL_SNAP_ENTRY) * snap->header.n_entries);
+   snap->attr = xmalloc(snap->header.attr_size);
+   snap->text = xmalloc(sizeof(unsigned short) * snap->header.text_size);
+   snap->used = xcalloc(1, snap->header.n_files);
+
+   size = sizeof(EL_SNAP_FILE) * snap->header.n_files;
+   if (my_read(fh, snap->file, size) != size) {
+      close(fh);
+      el_free_snapshot(snap);
+      return FALSE;
+   }
+   size = sizeof(EL_SNAP_ENTRY) * snap->header.n_entries;
+   if (my_read(fh, snap->entry, size) != size ||
+       my_read(fh, snap->attr, snap->header.attr_size) != snap->header.attr_size ||
+       snap->attr[snap->header.attr_size - 1] != 0 ||
+       my_read(fh, snap->text, sizeof(unsigned short) * snap->header.text_size) !=
+       (int) sizeof(unsigned short) * snap->header.text_size) {
+      close(fh);
+      el_free_snapshot(snap);
+      return FALSE;
+   }
+   close(fh);
+
+   for (i = 0; i < snap->header.n_files; i++)
+      if (memchr(snap->file[i].name, 0, sizeof(snap->file[i].name)) == NULL) {
+         el_free_snapshot(snap);
+         return FALSE;
+      }
+
+   for (i = 0; i < snap->header.n_entries; i++) {
+      if (snap->entry[i].attr_offset < 0 || snap->entry[i].attr_offset >= snap->header.attr_size) {
+         el_free_snapshot(snap);
+         return FALSE;
+      }
+
+      if (snap->header.text_size == 0)
+         continue;
+      pt = snap->text + snap->entry[i].text_offset;
+      if (snap->entry[i].text_offset < 0 || snap->entry[i].text_offset >= snap->header.text_size ||
+          pt[0] > EL_TEXT_BUCKETS || snap->entry[i].text_offset + pt[0] >= snap->header.text_size) {
+         el_free_snapshot(snap);
+         return FALSE;
+      }
+      for (j = 1; j <= pt[0]; j++)
+         if (pt[j] >= EL_TEXT_BUCKETS) {
+            el_free_snapshot(snap);
+            return FALSE;
+         }
+   }
+
+   return TRUE;
+}
+
+EL_SNAP_FILE *el_find_snapshot(LOGBOOK * lbs, EL_SNAPSHOT * snap, char *file_name)
+/* return snapshot record of a file if the file did not change since the snapshot was taken */
+{
+   EL_SNAP_FILE key, *f;
+   struct stat st;
+
+   if (snap->file == NULL)
+      return NULL;
+
+   strlcpy(key.name, file_name + strlen(lbs->data_dir), sizeof(key.name));
+   f = (EL_SNAP_FILE *) bsearch(&key, snap->file, snap->header.n_files, sizeof(EL_SNAP_FILE),
+                                el_snap_file_compare);
+   if (f == NULL)
+      return NULL;
+
+   /* files modified at or after the time of the scan might have changed without changing their mtime */
+   if (stat(file_name, &st) < 0 || (long long) st.st_mtime != f->mtime || (long long) st.st_size != f->size
+       || f->mtime >= snap->header.scan_time)
+      return NULL;
+
+   if (f->first < 0 || f->n < 0 || f->first > snap->header.n_entries - f->n)
+      return NULL;
+
+   snap->used[f - snap->file] = 1;
+   return f;
+}
+
+void el_apply_snapshot(LOGBOOK * lbs, EL_SNAPSHOT * snap, EL_SNAP_FILE * f, int file_id)
+/* append index entries of a file from the snapshot */
+{
+   int i, n;
+   char *p;
+   unsigned short *pt;
+
+   n = *lbs->n_el_index;
+   el_index_resize(lbs, n + f->n);
+   for (i = 0; i < f->n; i++) {
+      memset(&lbs->el_index[n + i], 0, sizeof(EL_INDEX));
+      lbs->el_index[n + i].file_id = file_id;
+      lbs->el_index[n + i].message_id = snap->entry[f->first + i].message_id;
+      lbs->el_index[n + i].offset = snap->entry[f->first + i].offset;
+      lbs->el_index[n + i].in_reply_to = snap->entry[f->first + i].in_reply_to;
+      lbs->el_index[n + i].file_time = (time_t) snap->entry[f->first + i].file_time;
+      memcpy(lbs->el_index[n + i].md5_digest, snap->entry[f->first + i].md5_digest, 16);
+
+      p = snap->attr + snap->entry[f->first + i].attr_offset;
+      lbs->el_index[n + i].attr_row = el_attr_new_row(lbs->el_attr);
+      el_attr_encode(lbs->el_attr, lbs->el_index[n + i].attr_row, p, strlen(p));
+
+      if (snap->header.text_size > 0) {
+         pt = snap->text + snap->entry[f->first + i].text_offset;
+         el_text_add(lbs->el_attr, lbs->el_index[n + i].attr_row, pt + 1, pt[0]);
+      }
+   }
+   lbs->el_files->file[file_id].dead_size = f->dead_size;
+}
+
+int el_save_snapshot(LOGBOOK * lbs, time_t scan_time)
+/* write the current index of a logbook into its data directory */
+{
+   char file_name[MAX_PATH_LENGTH], tmp_name[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
+   EL_SNAP_HEADER header;
+   EL_SNAP_FILE *file;
+   EL_SNAP_ENTRY *entry;
+   EL_INDEX *eli;
+   EL_FILE *f;
+   EL_ATTR_TABLE *t;
+   struct stat st;
+   char *attr, *value;
+   unsigned short *text, *bucket;
+   int i, j, n, fh, size, attr_alloc, status, *first;
+
+   n = *lbs->n_el_index;
+
+   /* group entries by file */
+   eli = xmalloc(sizeof(EL_INDEX) * n);
+   memcpy(eli, lbs->el_index, sizeof(EL_INDEX) * n);
+   qsort(eli, n, sizeof(EL_INDEX), eli_file_compare);
+
+   memset(&header, 0, sizeof(header));
+   strcpy(header.magic, ELOG_INDEX_MAGIC);
+   header.version = ELOG_INDEX_VERSION;
+   header.entry_size = sizeof(EL_SNAP_ENTRY);
+   header.scan_time = scan_time;
+
+   file = xmalloc(sizeof(EL_SNAP_FILE) * (n + 1));
+   entry = xmalloc(sizeof(EL_SNAP_ENTRY) * (n + 1));
+
+   /* offset 0 of the attribute section is an empty string for entries without a row */
+   t = lbs->el_attr;
+   attr_alloc = 65536;
+   attr = xmalloc(attr_alloc);
+   attr[0] = 0;
+   header.attr_size = 1;
+
+   /* same for the empty trigram list at offset 0 of the text section */
+   text = bucket = NULL;
+   first = NULL;
+   if (t && t->text) {
+      first = el_text_invert(t, &bucket);
+      text = xmalloc(sizeof(unsigned short) * (first[t->n_rows] + n + 1));
+      text[0] = 0;
+      header.text_size = 1;
+   }
+
+   for (i = 0; i < n; i++) {
+      if (i == 0 || eli[i].file_id != eli[i - 1].file_id) {
+         f = &lbs->el_files->file[eli[i].file_id];
+         memset(&file[header.n_files], 0, sizeof(EL_SNAP_FILE));
+         strlcpy(file[header.n_files].name, f->subdir, sizeof(file[header.n_files].name));
+         strlcat(file[header.n_files].name, f->file_name, sizeof(file[header.n_files].name));
+
+         /* files which vanished or whose name does not fit are never taken from the snapshot */
+         strlcpy(path, lbs->data_dir, sizeof(path));
+         strlcat(path, f->subdir, sizeof(path));
+         strlcat(path, f->file_name, sizeof(path));
+         if (stat(path, &st) < 0 ||
+             strlen(f->subdir) + strlen(f->file_name) >= sizeof(file[header.n_files].name))
+            file[header.n_files].mtime = -1;
+         else {
+            file[header.n_files].mtime = st.st_mtime;
+            file[header.n_files].size = st.st_size;
+         }
+         file[header.n_files].first = header.n_entries;
+         file[header.n_files].dead_size = f->dead_size;
+         header.n_files++;
+      }
+
+      entry[header.n_entries].message_id = eli[i].message_id;
+      entry[header.n_entries].offset = eli[i].offset;
+      entry[header.n_entries].in_reply_to = eli[i].in_reply_to;
+      entry[header.n_entries].file_time = eli[i].file_time;
+      memcpy(entry[header.n_entries].md5_digest, eli[i].md5_digest, 16);
+
+      entry[header.n_entries].attr_offset = 0;
+      if (t && eli[i].attr_row >= 0 && eli[i].attr_row < t->n_rows) {
+         entry[header.n_entries].attr_offset = header.attr_size;
+         for (j = 0; j < t->n_columns; j++) {
+            if (t->column[j].code[eli[i].attr_row] == 0)
+               continue;
+            value = t->column[j].value[t->column[j].code[eli[i].attr_row]];
+            size = strlen(t->column[j].name) + strlen(value) + 3;
+            while (header.attr_size + size + 1 > attr_alloc) {
+               attr_alloc *= 2;
+               attr = xrealloc(attr, attr_alloc);
+            }
+            sprintf(attr + header.attr_size, "%s: %s\n", t->column[j].name, value);
+            header.attr_size += size;
+         }
+         if (header.attr_size + 1 > attr_alloc) {
+            attr_alloc *= 2;
+            attr = xrealloc(attr, attr_alloc);
+         }
+         attr[header.attr_size++] = 0;
+      }
+
+      entry[header.n_entries].text_offset = 0;
+      if (text && eli[i].attr_row >= 0 && eli[i].attr_row < t->n_rows) {
+         entry[header.n_entries].text_offset = header.text_size;
+         size = first[eli[i].attr_row + 1] - first[eli[i].attr_row];
+         text[header.text_size] = size;
+         memcpy(text + header.text_size + 1, bucket + first[eli[i].attr_row], sizeof(unsigned short) * size);
+         header.text_size += size + 1;
+      }
+      header.n_entries++;
+      file[header.n_files - 1].n++;
+   }
+   xfree(eli);
+
+   /* mark invalid files so that they never match */
+   for (i = 0; i < header.n_files; i++)
+      if (file[i].mtime == -1)
+         file[i].name[0] = 0;
+
+   qsort(file, header.n_files, sizeof(EL_SNAP_FILE), el_snap_file_compare);
+
+   strlcpy(file_name, lbs->data_dir, sizeof(file_name));
+   strlcat(file_name, ELOG_INDEX_FILE, sizeof(file_name));
+   strlcpy(tmp_name, file_name, sizeof(tmp_name));
+   strlcat(tmp_name, ".tmp", sizeof(tmp_name));
+
+   status = FAILURE;
+   fh = open(tmp_name, O_CREAT | O_RDWR | O_BINARY | O_TRUNC, 0644);
+   if (fh >= 0) {
+      size = sizeof(EL_SNAP_FILE) * header.n_files;
+      if (write(fh, &header, sizeof(header)) == sizeof(header) &&
+          write(fh, file, size) == size &&
+          write(fh, entry, sizeof(EL_SNAP_ENTRY) * header.n_entries) ==
+          (int) sizeof(EL_SNAP_ENTRY) * header.n_entries &&
+          write(fh, attr, header.attr_size) == header.attr_size &&
+          write(fh, text, sizeof(unsigned short) * header.text_size) ==
+          (int) sizeof(unsigned short) * header.text_size)
+         status = SUCCESS;
+      close(fh);
+
+#ifdef OS_WINNT
+      remove(file_name);
+#endif
+      if (status == SUCCESS && rename(tmp_name, file_name) < 0)
+         status = FAILURE;
+      if (status != SUCCESS)
+         remove(tmp_name);
+   }
+
+   if (status != SUCCESS && get_verbose() >= VERBOSE_INFO)
+      eprintf("Cannot write index snapshot \"%s\": %s\n", file_name, strerror(errno));
+
+   xfree(file);
+   xfree(entry);
+   xfree(attr);
+   if (text) {
+      xfree(text);
+      xfree(bucket);
+      xfree(first);
+   }
+
+   return status;
+}
+
+/*------------------------------------------------------------------*/
+
+/* Building an index is done in three steps, so that the files of all
+   logbooks can be parsed in parallel: el_build_index_scan() collects the
+   files of a logbook and takes unchanged ones from the snapshot,
+   el_parse_files() parses the remaining files with a pool of threads and
+   el_build_index_merge() puts the entries together and sorts them once. */
+
+typedef struct {
+   LOGBOOK *lbs;
+   BOOL rebuild;
+   BOOL use_snapshot;
+   EL_SNAPSHOT snap;
+   time_t scan_time;
+   char *file_list;
+   int n_files;
+   EL_INDEX_TASK *task;
+} EL_INDEX_BUILD;
+
+int get_threads(char *option)
+/* number of threads given by a global option, by default one per processor */
+{
+   char str[80];
+   int n;
+
+   n = 0;
+   if (getcfg("global", option, str, sizeof(str)))
+      n = atoi(str);
+
+#ifdef OS_UNIX
+   if (n <= 0)
+      n = sysconf(_SC_NPROCESSORS_ONLN);
+   if (n > 64)
+      n = 64;
+#else
+   n = 1;
+#endif
+
+   if (n < 1)
+      n = 1;
+
+   return n;
+}
+
+int get_index_threads()
+/* number of threads used for parsing logbook files */
+{
+   /* keep debug output of parse_file() in order */
+   if (get_verbose() >= VERBOSE_DEBUG)
+      return 1;
+
+   return get_threads("Index threads");
+}
+
+#ifdef OS_UNIX
+
+typedef struct {
+   EL_INDEX_TASK **task;
+   int n_task;
+   int next;
+   pthread_mutex_t mutex;
+} EL_PARSE_QUEUE;
+
+void *el_parse_thread(void *arg)
+{
+   EL_PARSE_QUEUE *queue;
+   EL_INDEX_TASK *task;
+   int i;
+
+   queue = (EL_PARSE_QUEUE *) arg;
+   do {
+      pthread_mutex_lock(&queue->mutex);
+      i = queue->next++;
+      pthread_mutex_unlock(&queue->mutex);
+
+      if (i >= queue->n_task)
+         break;
+
+      task = queue->task[i];
+      task->status = parse_file(task);
+   } while (1);
+
+   return NULL;
+}
+
+#endif
 
-int el_build_index(LOGBOOK * lbs, BOOL rebuild)
-/* scan all ??????a.log files and build an index table in eli[] */
+void el_parse_files(EL_INDEX_TASK ** task, int n_task)
+/* parse files of all tasks, using several threads if configured */
 {
-   char *file_list, error_str[256], base_dir[256], *buffer;
-   int index, n;
-   int i, status;
+   int i, n_threads;
+
+   n_threads = get_index_threads();
+   if (n_threads > n_task)
+      n_threads = n_task;
+
+#ifdef OS_UNIX
+   if (n_threads > 1) {
+      EL_PARSE_QUEUE queue;
+      pthread_t *thread;
+
+      queue.task = task;
+      queue.n_task = n_task;
+      queue.next = 0;
+      pthread_mutex_init(&queue.mutex, NULL);
+
+      /* current thread takes part in the work, so it does not matter if some threads cannot be created */
+      thread = xmalloc(sizeof(pthread_t) * n_threads);
+      for (i = 0; i < n_threads - 1; i++)
+         if (pthread_create(&thread[i], NULL, el_parse_thread, &queue) != 0)
+            break;
+      n_threads = i;
+
+      el_parse_thread(&queue);
+
+      for (i = 0; i < n_threads; i++)
+         pthread_join(thread[i], NULL);
+
+      xfree(thread);
+      pthread_mutex_destroy(&queue.mutex);
+      return;
+   }
+#endif
+
+   for (i = 0; i < n_task; i++)
+      task[i]->status = parse_file(task[i]);
+}
+
+int el_build_index_scan(EL_INDEX_BUILD * b, LOGBOOK * lbs, BOOL rebuild)
+/* first step of building an index: find all ??????a.log files of a logbook,
+   return number of files which have to be parsed */
+{
+   char error_str[256], base_dir[256], *buffer;
+   int i, n_parse;
    unsigned char digest[16];
 
-   if (rebuild) {
+   memset(b, 0, sizeof(EL_INDEX_BUILD));
+   b->lbs = lbs;
+   b->rebuild = rebuild;
+
+   /* keep counter, hash, file and attribute table on rebuild, since they are shared with other logbooks */
+   if (rebuild)
       xfree(lbs->el_index);
-      xfree(lbs->n_el_index);
+   else {
+      lbs->n_el_index = xmalloc(sizeof(int));
+      lbs->id_hash = xcalloc(1, sizeof(EL_ID_HASH));
+      lbs->el_files = xcalloc(1, sizeof(EL_FILE_TABLE));
+      lbs->el_attr = xcalloc(1, sizeof(EL_ATTR_TABLE));
    }
 
-   lbs->n_el_index = xmalloc(sizeof(int));
    *lbs->n_el_index = 0;
-   lbs->el_index = xmalloc(0);
+   lbs->el_files->n = 0;
+   el_attr_free(lbs->el_attr);
+   el_text_init(lbs->el_attr);
+   lbs->el_index = xmalloc(sizeof(EL_INDEX) * el_index_capacity(0));
 
    /* get data directory */
    strcpy(base_dir, lbs->data_dir);
@@ -4123,39 +5913,607 @@ int el_build_index(LOGBOOK * lbs, BOOL rebuild)
    // move files to directories if (new layout to reduce number of files per directory)
    restructure_dir(base_dir);
 
+   /* load snapshot of previous index */
+   b->use_snapshot = el_snapshot_enabled();
+   if (b->use_snapshot)
+      el_load_snapshot(lbs, &b->snap);
+
+   time(&b->scan_time);
+   scan_dir_tree(lbs, base_dir, &b->file_list, &b->n_files);
+
+   /* parse only the files not covered by the snapshot */
+   b->task = xcalloc(b->n_files + 1, sizeof(EL_INDEX_TASK));
+   for (i = n_parse = 0; i < b->n_files; i++) {
+      b->task[i].lbs = lbs;
+      b->task[i].file_name = b->file_list + i * MAX_PATH_LENGTH;
+      b->task[i].file_id = el_file_id(lbs, b->task[i].file_name, TRUE);
+      b->task[i].snap_file = el_find_snapshot(lbs, &b->snap, b->task[i].file_name);
+      if (b->task[i].snap_file == NULL)
+         n_parse++;
+   }
+
+   return n_parse;
+}
+
+void el_append_task(LOGBOOK * lbs, EL_INDEX_TASK * task)
+/* append entries of a parsed file to the index and their attributes and trigrams
+   to the attribute table */
+{
+   char *p;
+   unsigned short *pt;
+   int i, n;
+
+   n = *lbs->n_el_index;
+   el_index_resize(lbs, n + task->n_el_index);
+   memcpy(lbs->el_index + n, task->el_index, sizeof(EL_INDEX) * task->n_el_index);
+
+   pt = task->trigrams;
+   for (i = 0, p = task->headers; i < task->n_el_index; i++, p += strlen(p) + 1) {
+      lbs->el_index[n + i].attr_row = el_attr_new_row(lbs->el_attr);
+      el_attr_encode(lbs->el_attr, lbs->el_index[n + i].attr_row, p, strlen(p));
+      if (pt) {
+         el_text_add(lbs->el_attr, lbs->el_index[n + i].attr_row, pt + 1, pt[0]);
+         pt += pt[0] + 1;
+      }
+   }
+
+   lbs->el_files->file[task->file_id].dead_size = task->dead_size;
+}
+
+int el_build_index_merge(EL_INDEX_BUILD * b)
+/* last step of building an index: collect entries of all files and sort them */
+{
+   LOGBOOK *lbs;
+   int i, n_parsed, status;
+   BOOL snapshot_dirty;
+
+   lbs = b->lbs;
+   status = EL_SUCCESS;
+   for (i = n_parsed = 0; i < b->n_files; i++) {
+      /* keep entries in file order, stop at first file which could not be parsed */
+      if (status == EL_SUCCESS) {
+         if (b->task[i].snap_file)
+            el_apply_snapshot(lbs, &b->snap, b->task[i].snap_file, b->task[i].file_id);
+         else if (b->task[i].status != SUCCESS)
+            status = b->task[i].status;
+         else {
+            el_append_task(lbs, &b->task[i]);
+            n_parsed++;
+         }
+      }
+
+      if (b->task[i].el_index)
+         xfree(b->task[i].el_index);
+      if (b->task[i].headers)
+         xfree(b->task[i].headers);
+      if (b->task[i].trigrams)
+         xfree(b->task[i].trigrams);
+   }
+   xfree(b->task);
+
+   if (status != EL_SUCCESS) {
+      if (b->file_list)
+         xfree(b->file_list);
+      el_free_snapshot(&b->snap);
+      el_id_hash_rebuild(lbs);
+      el_thread_rebuild(lbs);
+      el_share_index(lbs);
+      return status;
+   }
+
+   /* files removed since the snapshot was taken also require a new snapshot */
+   snapshot_dirty = (n_parsed > 0 || b->snap.file == NULL);
+   for (i = 0; i < b->snap.header.n_files; i++)
+      if (!b->snap.used[i])
+         snapshot_dirty = TRUE;
+   el_free_snapshot(&b->snap);
+
+   if (get_verbose() >= VERBOSE_INFO && b->use_snapshot)
+      eprintf("%d of %d files parsed ... ", n_parsed, b->n_files);
+
+   /* sort entries according to date */
+   qsort(lbs->el_index, *lbs->n_el_index, sizeof(EL_INDEX), eli_compare);
+   el_id_hash_rebuild(lbs);
+   el_thread_rebuild(lbs);
+   el_share_index(lbs);
+
+   if (b->use_snapshot && snapshot_dirty)
+      el_save_snapshot(lbs, b->scan_time);
+
+   if (get_verbose() >= VERBOSE_DEBUG) {
+      eprintf("After sort:\n");
+      for (i = 0; i < *lbs->n_el_index; i++)
+         eprintf("  ID %3d, %s, ofs %5d\n", lbs->el_index[i].message_id, el_file(lbs, i)->file_name,
+                 lbs->el_index[i].offset);
+   }
+
+   if (b->file_list)
+      xfree(b->file_list);
+
+   if (b->rebuild && b->n_files == 0) {
+      eprintf("Logbook files seem to have disappeared, aborting program.\n");
+      assert(b->rebuild && b->n_files > 0);
+   }
+   
+   return EL_SUCCESS;
+}
+
+void el_build_index_abort(EL_INDEX_BUILD * b)
+/* free a build which has been scanned but not merged */
+{
+   int i;
+
+   for (i = 0; i < b->n_files; i++) {
+      if (b->task[i].el_index)
+         xfree(b->task[i].el_index);
+      if (b->task[i].headers)
+         xfree(b->task[i].headers);
+      if (b->task[i].trigrams)
+         xfree(b->task[i].trigrams);
+   }
+   xfree(b->task);
+   if (b->file_list)
+      xfree(b->file_list);
+   el_free_snapshot(&b->snap);
+   el_id_hash_rebuild(b->lbs);
+   el_thread_rebuild(b->lbs);
+   el_share_index(b->lbs);
+}
+
+int el_build_index(LOGBOOK * lbs, BOOL rebuild)
+/* scan all ??????a.log files and build an index table in eli[] */
+{
+   EL_INDEX_BUILD build;
+   EL_INDEX_TASK **task;
+   int i, n;
+
+   el_build_index_scan(&build, lbs, rebuild);
+
+   task = xmalloc(sizeof(EL_INDEX_TASK *) * (build.n_files + 1));
+   for (i = n = 0; i < build.n_files; i++)
+      if (build.task[i].snap_file == NULL)
+         task[n++] = &build.task[i];
+   el_parse_files(task, n);
+   xfree(task);
+
+   return el_build_index_merge(&build);
+}
+
+/*------------------------------------------------------------------*/
+
+int el_reindex_file(LOGBOOK * lbs, char *file_name)
+/* re-parse a single ??????a.log file and replace its entries in the index,
+   used instead of a full rebuild if a file has been changed from outside */
+{
+   int i, j, status;
+   EL_INDEX_TASK task;
+   struct stat st;
+
+   el_file_cache_drop(file_name);
+
+   memset(&task, 0, sizeof(task));
+   task.lbs = lbs;
+   task.file_name = file_name;
+
+   /* remove old entries of this file */
+   task.file_id = el_file_id(lbs, file_name, FALSE);
+   for (i = j = 0; i < *lbs->n_el_index; i++)
+      if (lbs->el_index[i].file_id != task.file_id) {
+         if (i != j)
+            memcpy(&lbs->el_index[j], &lbs->el_index[i], sizeof(EL_INDEX));
+         j++;
+      }
+   i = *lbs->n_el_index - j;
+   el_index_resize(lbs, j);
+
+   /* file might have been deleted */
+   status = SUCCESS;
+   if (stat(file_name, &st) == 0)
+      status = parse_file(&task);
+   el_append_task(lbs, &task);
+   if (task.el_index)
+      xfree(task.el_index);
+   if (task.headers)
+      xfree(task.headers);
+   if (task.trigrams)
+      xfree(task.trigrams);
+
+   if (get_verbose() >= VERBOSE_INFO)
+      eprintf("Reindexed \"%s\": %d entries removed, %d entries added\n", file_name, i,
+              *lbs->n_el_index - j);
+
+   qsort(lbs->el_index, *lbs->n_el_index, sizeof(EL_INDEX), eli_compare);
+   el_id_hash_rebuild(lbs);
+   el_thread_rebuild(lbs);
+   el_share_index(lbs);
+
+   return status;
+}
+
+/*------------------------------------------------------------------*/
+
+#ifdef HAVE_INOTIFY
+
+/* Logbook directories and their year subdirectories are watched with inotify,
+   so that files changed from outside get re-parsed before the next request
+   instead of triggering a full rebuild of the index. Changes done by elogd
+   itself are remembered in el_watch_written[] and ignored. */
+
+typedef struct {
+   int wd;
+   char dir[MAX_PATH_LENGTH];
+} EL_WATCH;
+
+typedef struct {
+   char file_name[MAX_PATH_LENGTH];
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   struct timespec mtime;
+} EL_WATCH_WRITTEN;
+
+#define N_WATCH_WRITTEN 16
+
+int el_watch_fd = -1;
+int el_watch_generation = 0;    /* incremented for every new inotify descriptor */
+EL_WATCH *el_watch = NULL;
+int n_el_watch = 0;
+EL_WATCH_WRITTEN el_watch_written[N_WATCH_WRITTEN];
+int i_watch_written = 0;
+
+void el_watch_dir(char *dir)
+{
+   char str[MAX_PATH_LENGTH], *fl;
+   int wd, i, n;
+
+   wd = inotify_add_watch(el_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+                          IN_CREATE | IN_ONLYDIR);
+   if (wd < 0) {
+      if (get_verbose() >= VERBOSE_INFO)
+         eprintf("Cannot watch directory \"%s\": %s\n", dir, strerror(errno));
+      return;
+   }
+
+   for (i = 0; i < n_el_watch; i++)
+      if (el_watch[i].wd == wd)
+         break;
+   if (i == n_el_watch) {
+      el_watch = xrealloc(el_watch, sizeof(EL_WATCH) * (n_el_watch + 1));
+      n_el_watch++;
+   }
+   el_watch[i].wd = wd;
+   strlcpy(el_watch[i].dir, dir, sizeof(el_watch[i].dir));
+   if (el_watch[i].dir[strlen(el_watch[i].dir) - 1] != DIR_SEPARATOR)
+      strlcat(el_watch[i].dir, DIR_SEPARATOR_STR, sizeof(el_watch[i].dir));
+
+   /* watch year subdirectories */
+   fl = NULL;
+   n = ss_file_find(dir, "*", &fl);
+   for (i = 0; i < n; i++)
+      if (fnmatch1("????", &fl[i * MAX_PATH_LENGTH]) == 0 || fnmatch1("??", &fl[i * MAX_PATH_LENGTH]) == 0) {
+         if (strieq(fl + i * MAX_PATH_LENGTH, ".."))
+            continue;
+         strlcpy(str, dir, sizeof(str));
+         if (str[strlen(str) - 1] != DIR_SEPARATOR)
+            strlcat(str, DIR_SEPARATOR_STR, sizeof(str));
+         strlcat(str, fl + i * MAX_PATH_LENGTH, sizeof(str));
+         el_watch_dir(str);
+      }
+   if (fl)
+      xfree(fl);
+}
+
+void el_watch_logbooks()
+/* (re)install watches for all logbook data directories */
+{
+   int i, j;
+
+   if (el_watch_fd >= 0)
+      close(el_watch_fd);
+   xfree(el_watch);
+   el_watch = NULL;
+   n_el_watch = 0;
+
+   el_watch_fd = inotify_init();
+   if (el_watch_fd < 0) {
+      if (get_verbose() >= VERBOSE_INFO)
+         eprintf("Cannot initialize inotify: %s\n", strerror(errno));
+      return;
+   }
+   fcntl(el_watch_fd, F_SETFD, FD_CLOEXEC);
+
+   /* a child process might still hold the previous descriptor, whose events then wake up
+      the server loop without anything to read from this one */
+   fcntl(el_watch_fd, F_SETFL, fcntl(el_watch_fd, F_GETFL) | O_NONBLOCK);
+   el_watch_generation++;
+
+   for (i = 0; lb_list[i].name[0]; i++) {
+      for (j = 0; j < i; j++)
+         if (strcmp(lb_list[j].data_dir, lb_list[i].data_dir) == 0)
+            break;
+      if (j == i)
+         el_watch_dir(lb_list[i].data_dir);
+   }
+}
+
+void el_watch_ignore(char *file_name)
+/* remember a file written by elogd itself, so that its change event is ignored */
+{
+   struct stat st;
+   EL_WATCH_WRITTEN *w;
+
+   w = &el_watch_written[i_watch_written];
+   i_watch_written = (i_watch_written + 1) % N_WATCH_WRITTEN;
+
+   memset(w, 0, sizeof(EL_WATCH_WRITTEN));
+   strlcpy(w->file_name, file_name, sizeof(w->file_name));
+   if (stat(file_name, &st) == 0) {
+      w->dev = st.st_dev;
+      w->ino = st.st_ino;
+      w->size = st.st_size;
+      w->mtime = st.st_mtim;
+   } else
+      w->size = -1;
+}
+
+BOOL el_watch_is_ignored(char *file_name)
+{
+   struct stat st;
+   int i, exist;
+
+   exist = (stat(file_name, &st) == 0);
+
+   for (i = 0; i < N_WATCH_WRITTEN; i++)
+      if (el_watch_written[i].file_name[0] && strcmp(el_watch_written[i].file_name, file_name) == 0) {
+         if (!exist)
+            return el_watch_written[i].size == -1;
+         if (el_watch_written[i].dev == st.st_dev && el_watch_written[i].ino == st.st_ino &&
+             el_watch_written[i].size == st.st_size &&
+             el_watch_written[i].mtime.tv_sec == st.st_mtim.tv_sec &&
+             el_watch_written[i].mtime.tv_nsec == st.st_mtim.tv_nsec)
+            return TRUE;
+      }
+
+   return FALSE;
+}
+
+void el_watch_reindex_dir(LOGBOOK * lbs, char *dir)
+/* re-parse all files of a directory which appeared after the index was built */
+{
+   char *file_list;
+   int i, n;
+
    file_list = NULL;
    n = 0;
-   scan_dir_tree(lbs, base_dir, &file_list, &n);
-   
-   /* go through all files */
-   for (index = 0; index < n; index++) {
-      status = parse_file(lbs, file_list+index*MAX_PATH_LENGTH);
-      if (status != SUCCESS) {
-         if (file_list)
-            xfree(file_list);
-         return status;
+   scan_dir_tree(lbs, dir, &file_list, &n);
+   for (i = 0; i < n; i++)
+      if (!el_watch_is_ignored(file_list + i * MAX_PATH_LENGTH))
+         el_reindex_file(lbs, file_list + i * MAX_PATH_LENGTH);
+   if (file_list)
+      xfree(file_list);
+}
+
+void el_watch_process()
+/* read pending inotify events and update indices of changed files */
+{
+   char buffer[16384], file_name[MAX_PATH_LENGTH];
+   struct inotify_event *ev;
+   EL_WATCH *w;
+   LOGBOOK *lbs;
+   struct stat st;
+   int i, j, k, len;
+
+   len = read(el_watch_fd, buffer, sizeof(buffer));
+   if (len <= 0)
+      return;
+
+   for (i = 0; i < len; i += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *) (buffer + i);
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+         /* events have been lost, reindex all files file by file, since
+            el_build_index() aborts if the files have been removed meanwhile */
+         eprintf("Too many changes in logbook directories, reindexing all files\n");
+         for (j = 0; lb_list[j].name[0]; j++) {
+            for (k = 0; k < j; k++)
+               if (lb_list[k].n_el_index == lb_list[j].n_el_index)
+                  break;
+            if (!lb_list[j].n_el_index || k < j)
+               continue;
+            lbs = &lb_list[j];
+
+            /* drop entries of files which have disappeared */
+            for (k = 0; lbs->el_files && k < lbs->el_files->n; k++) {
+               strlcpy(file_name, lbs->data_dir, sizeof(file_name));
+               strlcat(file_name, lbs->el_files->file[k].subdir, sizeof(file_name));
+               strlcat(file_name, lbs->el_files->file[k].file_name, sizeof(file_name));
+               if (stat(file_name, &st) != 0)
+                  el_reindex_file(lbs, file_name);
+            }
+
+            /* re-parse existing and new files */
+            el_watch_reindex_dir(lbs, lbs->data_dir);
+         }
+         continue;
+      }
+
+      if (ev->len == 0)
+         continue;
+
+      for (j = 0, w = NULL; j < n_el_watch; j++)
+         if (el_watch[j].wd == ev->wd)
+            w = &el_watch[j];
+      if (w == NULL)
+         continue;
+
+      /* find logbook owning this directory, the longest matching data directory wins */
+      lbs = NULL;
+      for (j = 0; lb_list[j].name[0]; j++)
+         if (lb_list[j].n_el_index && strncmp(w->dir, lb_list[j].data_dir, strlen(lb_list[j].data_dir)) == 0
+             && (lbs == NULL || strlen(lb_list[j].data_dir) > strlen(lbs->data_dir)))
+            lbs = &lb_list[j];
+      if (lbs == NULL)
+         continue;
+
+      strlcpy(file_name, w->dir, sizeof(file_name));
+      strlcat(file_name, ev->name, sizeof(file_name));
+
+      if (ev->mask & IN_ISDIR) {
+         /* new year subdirectory */
+         if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+             (fnmatch1("????", ev->name) == 0 || fnmatch1("??", ev->name) == 0)) {
+            el_watch_dir(file_name);
+            el_watch_reindex_dir(lbs, file_name);
+         }
+         continue;
+      }
+
+      if (fnmatch1("??????a.log", ev->name) != 0 || (ev->mask & IN_CREATE))
+         continue;
+
+      if (el_watch_is_ignored(file_name))
+         continue;
+
+      el_reindex_file(lbs, file_name);
+   }
+}
+
+#endif                          /* HAVE_INOTIFY */
+
+/*------------------------------------------------------------------*/
+
+int el_compact_file(LOGBOOK * lbs, int file_id)
+/* rewrite a ??????a.log file without its tombstoned records and correct the
+   offsets of its entries, which is the only moment these offsets change */
+{
+   char file_name[MAX_PATH_LENGTH], tmp_name[MAX_PATH_LENGTH], *buffer, *data, *p, *pn;
+   int i, fh, length, len, size, n_moved, *moved, status;
+   BOOL in_sync;
+
+   strlcpy(file_name, lbs->data_dir, sizeof(file_name));
+   strlcat(file_name, lbs->el_files->file[file_id].subdir, sizeof(file_name));
+   strlcat(file_name, lbs->el_files->file[file_id].file_name, sizeof(file_name));
+
+   fh = open(file_name, O_RDONLY | O_BINARY, 0644);
+   if (fh < 0) {
+      lbs->el_files->file[file_id].dead_size = 0;
+      return EL_FILE_ERROR;
+   }
+   length = lseek(fh, 0, SEEK_END);
+   buffer = length > 0 ? el_read_file(fh, length) : NULL;
+   close(fh);
+   if (buffer == NULL) {
+      lbs->el_files->file[file_id].dead_size = 0;
+      return EL_FILE_ERROR;
+   }
+
+   /* copy live records, remember new offsets of their index entries as pairs */
+   data = xmalloc(length + 1);
+   moved = xmalloc(sizeof(int) * 2 * (length / 8 + 1));
+   n_moved = 0;
+   in_sync = TRUE;
+
+   p = el_next_record(buffer);
+   size = p ? p - buffer : length;
+   memcpy(data, buffer, size);
+
+   for (; p; p = pn) {
+      pn = el_next_record(p + 8);
+      len = pn ? pn - p : (int) strlen(p);
+      if (strncmp(p, EL_TOMBSTONE, 8) == 0)
+         continue;
+
+      i = el_find_index(lbs, atoi(p + 8));
+      if (i >= 0 && lbs->el_index[i].file_id == file_id && lbs->el_index[i].offset == p - buffer) {
+         moved[n_moved * 2] = i;
+         moved[n_moved * 2 + 1] = size;
+         n_moved++;
+      } else if (atoi(p + 8) > 0)
+         in_sync = FALSE;
+
+      memcpy(data + size, p, len);
+      size += len;
+   }
+   xfree(buffer);
+
+   status = EL_SUCCESS;
+   if (size == 0)
+      remove(file_name);
+   else {
+      strlcpy(tmp_name, file_name, sizeof(tmp_name));
+      strlcat(tmp_name, ".tmp", sizeof(tmp_name));
+
+      status = EL_FILE_ERROR;
+      fh = open(tmp_name, O_CREAT | O_RDWR | O_BINARY | O_TRUNC, 0644);
+      if (fh >= 0) {
+         if (write(fh, data, size) == size)
+            status = EL_SUCCESS;
+         close(fh);
+
+#ifdef OS_WINNT
+         if (status == EL_SUCCESS)
+            remove(file_name);
+#endif
+         if (status == EL_SUCCESS && rename(tmp_name, file_name) < 0)
+            status = EL_FILE_ERROR;
+         if (status != EL_SUCCESS)
+            remove(tmp_name);
       }
    }
 
-   if (file_list)
-      xfree(file_list);
+   if (status == EL_SUCCESS) {
+      el_file_cache_drop(file_name);
+#ifdef HAVE_INOTIFY
+      el_watch_ignore(file_name);
+#endif
+
+      if (get_verbose() >= VERBOSE_INFO)
+         eprintf("Compacted \"%s\": %d of %d bytes freed\n", file_name, length - size, length);
+
+      lbs->el_files->file[file_id].dead_size = 0;
+      if (in_sync) {
+         for (i = 0; i < n_moved; i++)
+            lbs->el_index[moved[i * 2]].offset = moved[i * 2 + 1];
+      } else
+         el_reindex_file(lbs, file_name);
+   } else {
+      eprintf("Cannot compact file \"%s\": %s\n", file_name, strerror(errno));
+      lbs->el_files->file[file_id].dead_size = 0;
+   }
+
+   xfree(moved);
+   xfree(data);
 
-   /* sort entries according to date */
-   qsort(lbs->el_index, *lbs->n_el_index, sizeof(EL_INDEX), eli_compare);
+   return status;
+}
 
-   if (get_verbose() >= VERBOSE_DEBUG) {
-      eprintf("After sort:\n");
-      for (i = 0; i < *lbs->n_el_index; i++)
-         eprintf("  ID %3d, %s, ofs %5d\n", lbs->el_index[i].message_id, lbs->el_index[i].file_name,
-                 lbs->el_index[i].offset);
-   }
+void el_compact_logbooks(BOOL all)
+/* compact one file containing tombstones, called while the server is idle, or
+   all of them if requested */
+{
+   int i, j, file_id;
 
-   if (rebuild && n == 0) {
-      eprintf("Logbook files seem to have disappeared, aborting program.\n");
-      assert(rebuild && n > 0);
+   if (lb_list == NULL)
+      return;
+
+   for (i = 0; lb_list[i].name[0]; i++) {
+      if (lb_list[i].el_files == NULL)
+         continue;
+
+      /* logbooks sharing an index share the file table */
+      for (j = 0; j < i; j++)
+         if (lb_list[j].el_files == lb_list[i].el_files)
+            break;
+      if (j < i)
+         continue;
+
+      for (file_id = 0; file_id < lb_list[i].el_files->n; file_id++)
+         if (lb_list[i].el_files->file[file_id].dead_size > 0) {
+            el_compact_file(&lb_list[i], file_id);
+            if (!all)
+               return;
+         }
    }
-   
-   return EL_SUCCESS;
 }
 
 /*------------------------------------------------------------------*/
@@ -4163,25 +6521,23 @@ int el_build_index(LOGBOOK * lbs, BOOL rebuild)
 int el_index_logbooks()
 {
    char str[256], data_dir[256], logbook[256], cwd[256], *p;
-   int i, j, n, status = 0;
+   int i, j, n, n_build, n_task, n_entries, n_files, status = 0;
+   size_t text_size;
+   EL_INDEX_BUILD *build;
+   EL_INDEX_TASK **task;
+   BOOL parallel;
+   double start_time;
 
-   if (lb_list) {
-      for (i = 0; lb_list[i].name[0]; i++) {
-         if (lb_list[i].el_index != NULL) {
-            xfree(lb_list[i].el_index);
-            xfree(lb_list[i].n_el_index);
+   start_time = get_wall_time();
 
-            /* check if other logbook uses same index */
-            for (j = i + 1; lb_list[j].name[0]; j++) {
-               /* mark that logbook already freed */
-               if (lb_list[j].el_index == lb_list[i].el_index)
-                  lb_list[j].el_index = NULL;
-            }
-         }
-      }
+   if (lb_list) {
+      el_free_index(lb_list);
       xfree(lb_list);
    }
 
+   /* cached entries belong to the previous logbooks */
+   el_entry_cache_clear(get_entry_cache_size());
+
    /* count logbooks */
    for (i = n = 0;; i++) {
       if (!enumgrp(i, str))
@@ -4194,6 +6550,12 @@ int el_index_logbooks()
    }
 
    lb_list = xcalloc(sizeof(LOGBOOK), n + 1);
+
+   /* with several threads, all logbooks are scanned first and their files parsed together */
+   parallel = get_index_threads() > 1;
+   build = xcalloc(n + 1, sizeof(EL_INDEX_BUILD));
+   n_build = n_task = 0;
+
    for (i = n = 0;; i++) {
       if (!enumgrp(i, logbook))
          break;
@@ -4205,6 +6567,9 @@ int el_index_logbooks()
       for (j = 0; j < i && lb_list[j].name[0]; j++)
          if (strieq(lb_list[j].name, logbook)) {
             eprintf("Error in configuration file: Duplicate logbook \"%s\"\n", logbook);
+            for (j = 0; j < n_build; j++)
+               el_build_index_abort(&build[j]);
+            xfree(build);
             return EL_DUPLICATE;
          }
 
@@ -4304,10 +6669,16 @@ int el_index_logbooks()
                eprintf("Logbook \"%s\" uses same directory as logbook \"%s\"\n", logbook, lb_list[j].name);
             lb_list[n].el_index = lb_list[j].el_index;
             lb_list[n].n_el_index = lb_list[j].n_el_index;
+            lb_list[n].id_hash = lb_list[j].id_hash;
+            lb_list[n].el_files = lb_list[j].el_files;
+            lb_list[n].el_attr = lb_list[j].el_attr;
             break;
          }
 
-      if (j == n) {
+      if (j == n && parallel) {
+         n_task += el_build_index_scan(&build[n_build++], &lb_list[n], FALSE);
+         status = EL_SUCCESS;
+      } else if (j == n) {
          if (get_verbose() >= VERBOSE_INFO)
             eprintf("Indexing logbook \"%s\" in \"%s\" ... ", logbook, lb_list[n].data_dir);
          eflush();
@@ -4322,12 +6693,73 @@ int el_index_logbooks()
             eprintf("Found empty logbook \"%s\"\n", logbook);
       } else if (status != EL_SUCCESS) {
          eprintf("Error generating index.\n");
+         xfree(build);
          return status;
       }
 
       n++;
    }
 
+   if (n_build > 0) {
+      /* parse files of all logbooks */
+      task = xmalloc(sizeof(EL_INDEX_TASK *) * (n_task + 1));
+      for (i = n_task = 0; i < n_build; i++)
+         for (j = 0; j < build[i].n_files; j++)
+            if (build[i].task[j].snap_file == NULL)
+               task[n_task++] = &build[i].task[j];
+      el_parse_files(task, n_task);
+      xfree(task);
+
+      for (i = 0; i < n_build; i++) {
+         if (get_verbose() >= VERBOSE_INFO)
+            eprintf("Indexing logbook \"%s\" in \"%s\" ... ", build[i].lbs->name, build[i].lbs->data_dir);
+         if (status == EL_SUCCESS) {
+            status = el_build_index_merge(&build[i]);
+            if (get_verbose() >= VERBOSE_INFO)
+               if (status == EL_SUCCESS)
+                  eprintf("ok\n");
+         } else
+            el_build_index_abort(&build[i]);
+      }
+
+      if (status != EL_SUCCESS) {
+         eprintf("Error generating index.\n");
+         xfree(build);
+         return status;
+      }
+   }
+   xfree(build);
+
+   if (get_verbose() >= VERBOSE_INFO)
+      eprintf("Indexed %d logbooks in %1.3lf s using %d thread%s\n", n, get_wall_time() - start_time,
+              get_index_threads(), get_index_threads() > 1 ? "s" : "");
+
+   if (get_verbose() >= VERBOSE_INFO) {
+      /* count shared indices only once */
+      text_size = 0;
+      for (i = n_entries = n_files = 0; i < n; i++) {
+         for (j = 0; j < i; j++)
+            if (lb_list[j].n_el_index == lb_list[i].n_el_index)
+               break;
+         if (j < i || lb_list[i].n_el_index == NULL)
+            continue;
+         n_entries += *lb_list[i].n_el_index;
+         n_files += lb_list[i].el_files->n;
+         if (lb_list[i].el_attr->text) {
+            text_size += EL_TEXT_BUCKETS * sizeof(EL_TEXT_LIST);
+            for (j = 0; j < EL_TEXT_BUCKETS; j++)
+               text_size += lb_list[i].el_attr->text[j].alloc;
+         }
+      }
+
+      /* paths are kept once per file instead of once per entry */
+      eprintf("Index of %d entries in %d files uses %d kB, %d kB saved by file table\n", n_entries, n_files,
+              (int) ((n_entries * sizeof(EL_INDEX) + n_files * sizeof(EL_FILE)) / 1024),
+              (int) ((n_entries - n_files) * sizeof(EL_FILE) / 1024));
+      if (text_size > 0)
+         eprintf("Text index uses %d kB\n", (int) (text_size / 1024));
+   }
+
    /* if top groups defined, set top group in logbook */
    if (exist_top_group()) {
       LBLIST phier;
@@ -4342,6 +6774,11 @@ int el_index_logbooks()
       free_logbook_hierarchy(phier);
    }
 
+#ifdef HAVE_INOTIFY
+   /* watch data directories for changes from outside */
+   el_watch_logbooks();
+#endif
+
    if (!load_password_files())
       return EL_INVAL_FILE;
 
@@ -4397,11 +6834,8 @@ int el_search_message(LOGBOOK * lbs, int mode, int message_id, BOOL head_only)
    }
 
    if (mode == EL_NEXT) {
-      for (i = 0; i < *lbs->n_el_index; i++)
-         if (lbs->el_index[i].message_id == message_id)
-            break;
-
-      if (i == *lbs->n_el_index)
+      i = el_find_index(lbs, message_id);
+      if (i < 0)
          return 0;              // message not found
 
       if (i == *lbs->n_el_index - 1)
@@ -4419,11 +6853,8 @@ int el_search_message(LOGBOOK * lbs, int mode, int message_id, BOOL head_only)
    }
 
    if (mode == EL_PREV) {
-      for (i = 0; i < *lbs->n_el_index; i++)
-         if (lbs->el_index[i].message_id == message_id)
-            break;
-
-      if (i == *lbs->n_el_index)
+      i = el_find_index(lbs, message_id);
+      if (i < 0)
          return 0;              // message not found
 
       if (i == 0)
@@ -4445,6 +6876,260 @@ int el_search_message(LOGBOOK * lbs, int mode, int message_id, BOOL head_only)
 
 /*------------------------------------------------------------------*/
 
+/* Decoded entries are kept in a cache, so that list pages, thread views and
+   the single entry page do not decode the same entry again and again. An
+   entry is identified by its data directory, message ID and the MD5 digest
+   from the index, so an entry changed in any way is never taken from the
+   cache. The total size is limited by "Entry cache = <kB>", least recently
+   used entries are dropped first. */
+
+#define N_ENTRY_CACHE_HASH 1024
+
+typedef struct EL_CACHED_ENTRY {
+   char *data_dir;
+   int message_id;
+   unsigned char md5_digest[16];
+   char *date;
+   char *in_reply_to;
+   char *reply_to;
+   char *attachment;
+   char *encoding;
+   char *locked_by;
+   char *draft;
+   char *header;                /* attribute lines including separator */
+   char *text;                  /* text after separator, NULL if there is no separator */
+   int size;                    /* total size of allocated block */
+   struct EL_CACHED_ENTRY *hash_next;
+   struct EL_CACHED_ENTRY *prev, *next;
+} EL_CACHED_ENTRY;
+
+typedef struct {
+   EL_CACHED_ENTRY *hash[N_ENTRY_CACHE_HASH];
+   EL_CACHED_ENTRY *first, *last;       /* most recently used first */
+   int n_entries;
+   int size;
+   int max_size;
+   int hits, misses;
+   int reported_hits, reported_misses;
+} EL_ENTRY_CACHE;
+
+EL_ENTRY_CACHE el_entry_cache;
+
+int get_entry_cache_size()
+/* maximum size of entry cache in bytes */
+{
+   char str[80];
+   int size;
+
+   size = 16 * 1024;
+   if (getcfg("global", "Entry cache", str, sizeof(str)))
+      size = atoi(str);
+   if (size < 0)
+      size = 0;
+   if (size > 1024 * 1024)
+      size = 1024 * 1024;
+
+   return size * 1024;
+}
+
+static void el_entry_cache_remove(EL_CACHED_ENTRY * e)
+{
+   EL_CACHED_ENTRY **pe;
+
+   for (pe = &el_entry_cache.hash[e->message_id & (N_ENTRY_CACHE_HASH - 1)]; *pe != e; pe = &(*pe)->hash_next);
+   *pe = e->hash_next;
+
+   if (e->prev)
+      e->prev->next = e->next;
+   else
+      el_entry_cache.first = e->next;
+   if (e->next)
+      e->next->prev = e->prev;
+   else
+      el_entry_cache.last = e->prev;
+
+   el_entry_cache.n_entries--;
+   el_entry_cache.size -= e->size;
+   xfree(e);
+}
+
+void el_entry_cache_clear(int max_size)
+/* drop all cached entries and set maximum size in bytes */
+{
+   while (el_entry_cache.first)
+      el_entry_cache_remove(el_entry_cache.first);
+   el_entry_cache.max_size = max_size;
+}
+
+void el_entry_cache_invalidate(LOGBOOK * lbs, int message_id)
+/* drop cached entry after it has been changed or deleted */
+{
+   EL_CACHED_ENTRY *e;
+
+   for (e = el_entry_cache.hash[message_id & (N_ENTRY_CACHE_HASH - 1)]; e; e = e->hash_next)
+      if (e->message_id == message_id && strcmp(e->data_dir, lbs->data_dir) == 0) {
+         el_entry_cache_remove(e);
+         return;
+      }
+}
+
+EL_CACHED_ENTRY *el_entry_cache_find(LOGBOOK * lbs, int index)
+/* return cached entry for position "index" in el_index, or NULL */
+{
+   EL_CACHED_ENTRY *e;
+   int message_id;
+
+   message_id = lbs->el_index[index].message_id;
+   for (e = el_entry_cache.hash[message_id & (N_ENTRY_CACHE_HASH - 1)]; e; e = e->hash_next)
+      if (e->message_id == message_id && strcmp(e->data_dir, lbs->data_dir) == 0)
+         break;
+
+   if (e && memcmp(e->md5_digest, lbs->el_index[index].md5_digest, 16) != 0) {
+      /* entry has been changed */
+      el_entry_cache_remove(e);
+      e = NULL;
+   }
+
+   if (e == NULL) {
+      el_entry_cache.misses++;
+      return NULL;
+   }
+
+   /* move to front of LRU list */
+   if (e->prev) {
+      e->prev->next = e->next;
+      if (e->next)
+         e->next->prev = e->prev;
+      else
+         el_entry_cache.last = e->prev;
+      e->prev = NULL;
+      e->next = el_entry_cache.first;
+      el_entry_cache.first->prev = e;
+      el_entry_cache.first = e;
+   }
+
+   el_entry_cache.hits++;
+   return e;
+}
+
+static char *el_entry_string(char **p, char *str)
+{
+   char *s;
+
+   s = *p;
+   strcpy(s, str);
+   *p += strlen(str) + 1;
+   return s;
+}
+
+EL_CACHED_ENTRY *el_decode_entry(LOGBOOK * lbs, int index, char *message)
+/* decode all fields of an entry into a single allocated block */
+{
+   char date[80], in_reply_to[80], reply_to[MAX_REPLY_TO * 10], attachment[64 * MAX_ATTACHMENTS];
+   char encoding[80], locked_by[80], draft[80], *pt, *p;
+   int header_size, text_size, size;
+   EL_CACHED_ENTRY *e;
+
+   el_decode(message, "Date: ", date, sizeof(date));
+   el_decode_int(message, "In reply to: ", in_reply_to, sizeof(in_reply_to));
+   el_decode_intlist(message, "Reply to: ", reply_to, sizeof(reply_to));
+   el_decode(message, "Attachment: ", attachment, sizeof(attachment));
+   el_decode(message, "Encoding: ", encoding, sizeof(encoding));
+   el_decode(message, "Locked by: ", locked_by, sizeof(locked_by));
+   el_decode(message, "Draft: ", draft, sizeof(draft));
+
+   /* header includes the separator line */
+   header_size = el_header_size(message);
+   header_size = header_size >= 0 ? header_size + 41 : (int) strlen(message);
+
+   pt = strstr(message, "========================================\n");
+
+   /* check for \n -> \r conversion (e.g. zipping/unzipping) */
+   if (pt == NULL)
+      pt = strstr(message, "========================================\r");
+   if (pt)
+      pt += 41;
+   text_size = pt ? (int) strlen(pt) + 1 : 0;
+
+   size = sizeof(EL_CACHED_ENTRY) + strlen(lbs->data_dir) + strlen(date) + strlen(in_reply_to) +
+       strlen(reply_to) + strlen(attachment) + strlen(encoding) + strlen(locked_by) + strlen(draft) + 8 +
+       header_size + 1 + text_size;
+
+   e = xmalloc(size);
+   memset(e, 0, sizeof(EL_CACHED_ENTRY));
+   e->size = size;
+   e->message_id = lbs->el_index[index].message_id;
+   memcpy(e->md5_digest, lbs->el_index[index].md5_digest, 16);
+
+   p = (char *) (e + 1);
+   e->data_dir = el_entry_string(&p, lbs->data_dir);
+   e->date = el_entry_string(&p, date);
+   e->in_reply_to = el_entry_string(&p, in_reply_to);
+   e->reply_to = el_entry_string(&p, reply_to);
+   e->attachment = el_entry_string(&p, attachment);
+   e->encoding = el_entry_string(&p, encoding);
+   e->locked_by = el_entry_string(&p, locked_by);
+   e->draft = el_entry_string(&p, draft);
+
+   e->header = p;
+   memcpy(e->header, message, header_size);
+   e->header[header_size] = 0;
+   p += header_size + 1;
+
+   if (pt) {
+      e->text = p;
+      memcpy(e->text, pt, text_size);
+   }
+
+   return e;
+}
+
+BOOL el_entry_cache_add(EL_CACHED_ENTRY * e)
+/* put decoded entry into cache, return FALSE if it does not fit and has to be freed by the caller */
+{
+   EL_CACHED_ENTRY **pe;
+
+   /* do not let a single entry flush the whole cache */
+   if (e->size > el_entry_cache.max_size / 8)
+      return FALSE;
+
+   while (el_entry_cache.last && el_entry_cache.size + e->size > el_entry_cache.max_size)
+      el_entry_cache_remove(el_entry_cache.last);
+
+   pe = &el_entry_cache.hash[e->message_id & (N_ENTRY_CACHE_HASH - 1)];
+   e->hash_next = *pe;
+   *pe = e;
+
+   e->prev = NULL;
+   e->next = el_entry_cache.first;
+   if (el_entry_cache.first)
+      el_entry_cache.first->prev = e;
+   else
+      el_entry_cache.last = e;
+   el_entry_cache.first = e;
+
+   el_entry_cache.n_entries++;
+   el_entry_cache.size += e->size;
+   return TRUE;
+}
+
+void el_entry_cache_report()
+/* show cache statistics if they changed since the last call */
+{
+   if (el_entry_cache.hits == el_entry_cache.reported_hits &&
+       el_entry_cache.misses == el_entry_cache.reported_misses)
+      return;
+
+   if (get_verbose() >= VERBOSE_INFO)
+      eprintf("Entry cache: %d hits, %d misses, %d entries, %d kB\n", el_entry_cache.hits,
+              el_entry_cache.misses, el_entry_cache.n_entries, el_entry_cache.size / 1024);
+
+   el_entry_cache.reported_hits = el_entry_cache.hits;
+   el_entry_cache.reported_misses = el_entry_cache.misses;
+}
+
+/*------------------------------------------------------------------*/
+
 int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_ATTR][NAME_LENGTH],
                 char attrib[MAX_N_ATTR][NAME_LENGTH], int n_attr, char *text, int *textsize,
                 char *in_reply_to, char *reply_to, char attachment[MAX_ATTACHMENTS][MAX_PATH_LENGTH],
@@ -4482,9 +7167,11 @@ int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_
 
  \********************************************************************/
 {
-   int i, index, size, fh;
-   char str[NAME_LENGTH], file_name[256], *p;
+   int i, index, size, file_size, status;
+   char str[NAME_LENGTH], file_name[256], *p, *buffer;
    char *message, attachment_all[64 * MAX_ATTACHMENTS];
+   EL_CACHED_ENTRY *e;
+   BOOL cached;
 
    if (message_id == 0)
       /* open most recent message */
@@ -4493,70 +7180,65 @@ int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_
    if (message_id == 0)
       return EL_EMPTY;
 
-   for (index = 0; index < *lbs->n_el_index; index++)
-      if (lbs->el_index[index].message_id == message_id)
-         break;
-
-   if (index == *lbs->n_el_index)
+   index = el_find_index(lbs, message_id);
+   if (index < 0)
       return EL_NO_MSG;
 
-   sprintf(file_name, "%s%s%s", lbs->data_dir, lbs->el_index[index].subdir, lbs->el_index[index].file_name);
-   fh = open(file_name, O_RDONLY | O_BINARY, 0644);
-   if (fh < 0) {
-      /* file might have been deleted, rebuild index */
-      el_build_index(lbs, TRUE);
-      return el_retrieve(lbs, message_id, date, attr_list, attrib, n_attr, text, textsize, in_reply_to,
-                         reply_to, attachment, encoding, locked_by, draft);
-   }
+   e = el_entry_cache_find(lbs, index);
+   cached = (e != NULL);
 
-   message = xmalloc(TEXT_SIZE + 1000);
+   if (e == NULL) {
+      sprintf(file_name, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
+      buffer = el_file_cache_get(file_name, &file_size);
+      if (buffer == NULL) {
+         /* file might have been deleted, reindex it */
+         el_reindex_file(lbs, file_name);
+         return el_retrieve(lbs, message_id, date, attr_list, attrib, n_attr, text, textsize, in_reply_to,
+                            reply_to, attachment, encoding, locked_by, draft);
+      }
 
-   lseek(fh, lbs->el_index[index].offset, SEEK_SET);
-   i = my_read(fh, message, TEXT_SIZE + 1000 - 1);
-   if (i <= 0) {
-      xfree(message);
-      close(fh);
-      return EL_FILE_ERROR;
-   }
+      if (lbs->el_index[index].offset >= file_size ||
+          strncmp(buffer + lbs->el_index[index].offset, "$@MID@$:", 8) != 0 ||
+          atoi(buffer + lbs->el_index[index].offset + 8) != message_id) {
+         /* file might have been edited, possibly by the parent of a forked
+            search which rewrote the tail of the file, reindex it */
+         el_reindex_file(lbs, file_name);
+         return el_retrieve(lbs, message_id, date, attr_list, attrib, n_attr, text, textsize, in_reply_to,
+                            reply_to, attachment, encoding, locked_by, draft);
+      }
+      buffer += lbs->el_index[index].offset;
 
-   message[i] = 0;
-   close(fh);
+      /* decode message size */
+      p = el_next_record(buffer + 8);
+      if (p == NULL)
+         size = strlen(buffer);
+      else
+         size = p - buffer;
+      if (size > TEXT_SIZE + 1000 - 1)
+         size = TEXT_SIZE + 1000 - 1;
 
-   if (strncmp(message, "$@MID@$:", 8) != 0) {
-      xfree(message);
-      /* file might have been edited, rebuild index */
-      el_build_index(lbs, TRUE);
-      return el_retrieve(lbs, message_id, date, attr_list, attrib, n_attr, text, textsize, in_reply_to,
-                         reply_to, attachment, encoding, locked_by, draft);
-   }
+      /* copy only this entry out of the cached file */
+      message = xmalloc(size + 1);
+      memcpy(message, buffer, size);
+      message[size] = 0;
 
-   /* check for correct ID */
-   if (atoi(message + 8) != message_id) {
+      e = el_decode_entry(lbs, index, message);
       xfree(message);
-      return EL_FILE_ERROR;
+      cached = el_entry_cache_add(e);
    }
 
-   /* decode message size */
-   p = strstr(message + 8, "$@MID@$:");
-   if (p == NULL)
-      size = strlen(message);
-   else
-      size = p - message;
-
-   message[size] = 0;
-
-   /* decode message */
+   /* copy decoded message */
    if (date)
-      el_decode(message, "Date: ", date, 80);
+      strlcpy(date, e->date, 80);
    if (reply_to)
-      el_decode_intlist(message, "Reply to: ", reply_to, MAX_REPLY_TO * 10);
+      strlcpy(reply_to, e->reply_to, MAX_REPLY_TO * 10);
    if (in_reply_to)
-      el_decode_int(message, "In reply to: ", in_reply_to, 80);
+      strlcpy(in_reply_to, e->in_reply_to, 80);
 
    if (n_attr == -1) {
       /* derive attribute names from message */
       for (i = 0;; i++) {
-         el_enum_attr(message, i, attr_list[i], attrib[i]);
+         el_enum_attr(e->header, i, attr_list[i], attrib[i]);
          if (!attr_list[i][0])
             break;
       }
@@ -4566,13 +7248,13 @@ int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_
       if (attrib)
          for (i = 0; i < n_attr; i++) {
             sprintf(str, "%s: ", attr_list[i]);
-            el_decode(message, str, attrib[i], NAME_LENGTH);
+            el_decode(e->header, str, attrib[i], NAME_LENGTH);
          }
    }
 
-   el_decode(message, "Attachment: ", attachment_all, sizeof(attachment_all));
+   strlcpy(attachment_all, e->attachment, sizeof(attachment_all));
    if (encoding)
-      el_decode(message, "Encoding: ", encoding, 80);
+      strlcpy(encoding, e->encoding, 80);
 
    if (attachment) {
       /* break apart attachements */
@@ -4596,25 +7278,20 @@ int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_
    }
 
    if (locked_by)
-      el_decode(message, "Locked by: ", locked_by, 80);
+      strlcpy(locked_by, e->locked_by, 80);
 
    if (draft)
-      el_decode(message, "Draft: ", draft, 80);
-
-   p = strstr(message, "========================================\n");
+      strlcpy(draft, e->draft, 80);
 
-   /* check for \n -> \r conversion (e.g. zipping/unzipping) */
-   if (p == NULL)
-      p = strstr(message, "========================================\r");
+   status = EL_SUCCESS;
+   p = e->text;
 
    if (text) {
       if (p != NULL) {
-         p += 41;
          if ((int) strlen(p) >= *textsize) {
             strlcpy(text, p, *textsize);
             show_error("Entry too long to display. Please increase TEXT_SIZE and recompile elogd.");
-            xfree(message);
-            return EL_FILE_ERROR;
+            status = EL_FILE_ERROR;
          } else {
             strlcpy(text, p, *textsize);
 
@@ -4633,8 +7310,9 @@ int el_retrieve(LOGBOOK * lbs, int message_id, char *date, char attr_list[MAX_N_
       }
    }
 
-   xfree(message);
-   return EL_SUCCESS;
+   if (!cached)
+      xfree(e);
+   return status;
 }
 
 /*------------------------------------------------------------------*/
@@ -4747,60 +7425,64 @@ void el_delete_attachment(LOGBOOK * lbs, char *file_name)
 
 int el_retrieve_attachment(LOGBOOK * lbs, int message_id, int n, char name[MAX_PATH_LENGTH])
 {
-   int i, index, size, fh;
-   char file_name[256], *p;
-   char message[TEXT_SIZE + 1000], attachment_all[64 * MAX_ATTACHMENTS];
+   int i, index, size, file_size;
+   char file_name[256], *p, *buffer;
+   char *message, attachment_all[64 * MAX_ATTACHMENTS];
+   EL_CACHED_ENTRY *e;
 
    if (message_id == 0)
       return EL_EMPTY;
 
-   for (index = 0; index < *lbs->n_el_index; index++)
-      if (lbs->el_index[index].message_id == message_id)
-         break;
-
-   if (index == *lbs->n_el_index)
+   index = el_find_index(lbs, message_id);
+   if (index < 0)
       return EL_NO_MSG;
 
-   sprintf(file_name, "%s%s%s", lbs->data_dir, lbs->el_index[index].subdir, lbs->el_index[index].file_name);
-   fh = open(file_name, O_RDONLY | O_BINARY, 0644);
-   if (fh < 0) {
-      /* file might have been deleted, rebuild index */
-      el_build_index(lbs, TRUE);
-      return el_retrieve_attachment(lbs, message_id, n, name);
+   e = el_entry_cache_find(lbs, index);
+   if (e) {
+      strlcpy(attachment_all, e->attachment, sizeof(attachment_all));
+      goto split;
    }
 
-   lseek(fh, lbs->el_index[index].offset, SEEK_SET);
-   i = my_read(fh, message, sizeof(message) - 1);
-   if (i <= 0) {
-      close(fh);
-      return EL_FILE_ERROR;
+   sprintf(file_name, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
+   buffer = el_file_cache_get(file_name, &file_size);
+   if (buffer == NULL) {
+      /* file might have been deleted, reindex it */
+      el_reindex_file(lbs, file_name);
+      return el_retrieve_attachment(lbs, message_id, n, name);
    }
 
-   message[i] = 0;
-   close(fh);
-
-   if (strncmp(message, "$@MID@$:", 8) != 0) {
-      /* file might have been edited, rebuild index */
-      el_build_index(lbs, TRUE);
+   if (lbs->el_index[index].offset >= file_size ||
+       strncmp(buffer + lbs->el_index[index].offset, "$@MID@$:", 8) != 0 ||
+       atoi(buffer + lbs->el_index[index].offset + 8) != message_id) {
+      /* file might have been edited, reindex it */
+      el_reindex_file(lbs, file_name);
       return el_retrieve_attachment(lbs, message_id, n, name);
    }
-
-   /* check for correct ID */
-   if (atoi(message + 8) != message_id)
-      return EL_FILE_ERROR;
+   buffer += lbs->el_index[index].offset;
 
    /* decode message size */
-   p = strstr(message + 8, "$@MID@$:");
+   p = el_next_record(buffer + 8);
    if (p == NULL)
-      size = strlen(message);
+      size = strlen(buffer);
    else
-      size = p - message;
+      size = p - buffer;
+   if (size > TEXT_SIZE + 1000 - 1)
+      size = TEXT_SIZE + 1000 - 1;
 
+   message = xmalloc(size + 1);
+   memcpy(message, buffer, size);
    message[size] = 0;
 
-   el_decode(message, "Attachment: ", attachment_all, sizeof(attachment_all));
+   /* decode whole entry, since it is usually retrieved next */
+   e = el_decode_entry(lbs, index, message);
+   xfree(message);
+   strlcpy(attachment_all, e->attachment, sizeof(attachment_all));
+   if (!el_entry_cache_add(e))
+      xfree(e);
 
+ split:
    name[0] = 0;
+   p = NULL;
 
    for (i = 0; i <= n; i++) {
       if (i == 0)
@@ -4855,14 +7537,16 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
 
  \********************************************************************/
 {
-   int n, i, j, size, fh, index, tail_size, orig_size, delta, reply_id;
+   int n, i, size, fh, index, tail_size, orig_size, old_offset, delta, reply_id;
    char file_name[256], dir[256], str[NAME_LENGTH], date1[256], attrib[MAX_N_ATTR][NAME_LENGTH],
        reply_to1[MAX_REPLY_TO * 10], in_reply_to1[MAX_REPLY_TO * 10], encoding1[80], *message, *p,
        *old_text, *buffer, locked_by1[256];
    char attachment_all[64 * MAX_ATTACHMENTS], subdir[MAX_PATH_LENGTH];
    time_t ltime;
+   BOOL append, adopt;
 
-   tail_size = orig_size = 0;
+   tail_size = orig_size = old_offset = 0;
+   append = adopt = FALSE;
 
    buffer = NULL;
    message = xmalloc(TEXT_SIZE + 100);
@@ -4882,16 +7566,13 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
 
    if (bedit) {
       /* edit existing message */
-      for (index = 0; index < *lbs->n_el_index; index++)
-         if (lbs->el_index[index].message_id == message_id)
-            break;
-
-      if (index == *lbs->n_el_index) {
+      index = el_find_index(lbs, message_id);
+      if (index < 0) {
          xfree(message);
          return -1;
       }
 
-      sprintf(file_name, "%s%s%s", lbs->data_dir, lbs->el_index[index].subdir, lbs->el_index[index].file_name);
+      sprintf(file_name, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
       fh = open(file_name, O_CREAT | O_RDWR | O_BINARY, 0644);
       if (fh < 0) {
          xfree(message);
@@ -4910,8 +7591,8 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
          close(fh);
          xfree(message);
 
-         /* file might have been edited, rebuild index */
-         el_build_index(lbs, TRUE);
+         /* file might have been edited, reindex it */
+         el_reindex_file(lbs, file_name);
          return el_submit(lbs, message_id, bedit, date, attr_name, attrib, n_attr, text, in_reply_to,
                           reply_to, encoding, afilename, mark_original, locked_by, draft);
       }
@@ -4924,7 +7605,7 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
       }
 
       /* decode message size */
-      p = strstr(message + 8, "$@MID@$:");
+      p = el_next_record(message + 8);
       if (p == NULL)
          size = strlen(message);
       else
@@ -4970,15 +7651,23 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
       /* buffer tail of logfile */
       lseek(fh, 0, SEEK_END);
       orig_size = size;
-      tail_size = TELL(fh) - (lbs->el_index[index].offset + size);
-
-      if (tail_size > 0) {
-         buffer = xmalloc(tail_size);
+      old_offset = lbs->el_index[index].offset;
+      tail_size = TELL(fh) - (old_offset + size);
+
+      if (tail_size > 0 && el_append_only()) {
+         /* write new version to end of file, old one gets a tombstone below */
+         append = TRUE;
+         tail_size = 0;
+         lbs->el_index[index].offset = TELL(fh);
+      } else {
+         if (tail_size > 0) {
+            buffer = xmalloc(tail_size);
 
-         lseek(fh, lbs->el_index[index].offset + size, SEEK_SET);
-         n = my_read(fh, buffer, tail_size);
+            lseek(fh, old_offset + size, SEEK_SET);
+            n = my_read(fh, buffer, tail_size);
+         }
+         lseek(fh, old_offset, SEEK_SET);
       }
-      lseek(fh, lbs->el_index[index].offset, SEEK_SET);
    } else {
       /* create new message */
       if (!date[0]) {
@@ -5018,40 +7707,34 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
       lseek(fh, 0, SEEK_END);
 
       /* new message id is old plus one */
-      if (message_id == 0) {
-         message_id = 1;
-         for (i = 0; i < *lbs->n_el_index; i++)
-            if (lbs->el_index[i].message_id >= message_id)
-               message_id = lbs->el_index[i].message_id + 1;
-      }
+      adopt = (message_id != 0);
+      if (message_id == 0)
+         message_id = lbs->id_hash->max_id + 1;
 
-      /* enter message in index */
-      index = *lbs->n_el_index;
+      /* enter message in index after all older entries, to keep it sorted by date */
+      index = el_find_time(lbs, ltime);
 
-      (*lbs->n_el_index)++;
-      lbs->el_index = xrealloc(lbs->el_index, sizeof(EL_INDEX) * (*lbs->n_el_index));
+      el_index_resize(lbs, *lbs->n_el_index + 1);
+      if (index < *lbs->n_el_index - 1)
+         memmove(&lbs->el_index[index + 1], &lbs->el_index[index],
+                 sizeof(EL_INDEX) * (*lbs->n_el_index - 1 - index));
       lbs->el_index[index].message_id = message_id;
-      strlcpy(lbs->el_index[index].file_name, file_name, sizeof(lbs->el_index[index].file_name));
-      strlcpy(lbs->el_index[index].subdir, subdir, sizeof(lbs->el_index[index].subdir));
+      lbs->el_index[index].file_id = el_file_id(lbs, str, FALSE);
       lbs->el_index[index].file_time = ltime;
       lbs->el_index[index].offset = TELL(fh);
       lbs->el_index[index].in_reply_to = atoi(in_reply_to1);
+      lbs->el_index[index].thread_head = message_id;
+      lbs->el_index[index].first_reply = lbs->el_index[index].next_reply = 0;
+      lbs->el_index[index].attr_row = -1;
 
-      /* if index not ordered, sort it */
-      i = *lbs->n_el_index;
-      if (i > 1 && lbs->el_index[i - 1].file_time < lbs->el_index[i - 2].file_time) {
-         qsort(lbs->el_index, i, sizeof(EL_INDEX), eli_compare);
-
-         /* search message again, index could have been changed by sorting */
-         for (index = 0; index < *lbs->n_el_index; index++)
-            if (lbs->el_index[index].message_id == message_id)
-               break;
-      }
+      /* positions of following entries have changed if not appended */
+      if (index < *lbs->n_el_index - 1)
+         el_id_hash_rebuild(lbs);
+      else
+         el_id_hash_add(lbs, index);
 
       /* if other logbook has same index, update pointers */
-      for (i = 0; lb_list[i].name[0]; i++)
-         if (&lb_list[i] != lbs && lb_list[i].n_el_index == lbs->n_el_index)
-            lb_list[i].el_index = lbs->el_index;
+      el_share_index(lbs);
    }
 
    /* compose message */
@@ -5106,21 +7789,42 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
    /* update MD5 checksum */
    MD5_checksum(message, strlen(message), lbs->el_index[index].md5_digest);
 
-   if (bedit) {
+   /* add new entry to its thread, an entry with given ID might have replies already */
+   if (!bedit)
+      el_thread_link(lbs, index, adopt);
+   else if (lbs->el_index[index].in_reply_to != atoi(in_reply_to1)) {
+      el_thread_unlink(lbs, index);
+      lbs->el_index[index].in_reply_to = atoi(in_reply_to1);
+      el_thread_link(lbs, index, FALSE);
+   }
+
+   /* update attribute table and text index, an edited entry keeps its row */
+   if (lbs->el_attr) {
+      if (lbs->el_index[index].attr_row < 0 || lbs->el_index[index].attr_row >= lbs->el_attr->n_rows)
+         lbs->el_index[index].attr_row = el_attr_new_row(lbs->el_attr);
+      el_attr_encode(lbs->el_attr, lbs->el_index[index].attr_row, message, el_header_size(message));
+      el_text_encode(lbs->el_attr, lbs->el_index[index].attr_row, message, strlen(message));
+   }
+
+   if (bedit && append) {
+      /* mark old version as deleted */
+      lseek(fh, old_offset, SEEK_SET);
+      n = write(fh, EL_TOMBSTONE, 8);
+      el_file(lbs, index)->dead_size += orig_size;
+   } else if (bedit) {
       if (tail_size > 0) {
          n = write(fh, buffer, tail_size);
          xfree(buffer);
 
-         /* correct offsets for remaining messages in same file */
+         /* correct offsets for remaining messages in same file, which are not
+            necessarily the following ones in the index if the file contains
+            versions appended by edits */
          delta = strlen(message) - orig_size;
 
          for (i = 0; i < *lbs->n_el_index; i++)
-            if (lbs->el_index[i].message_id == message_id)
-               break;
-
-         for (j = i + 1; j < *lbs->n_el_index && strieq(lbs->el_index[i].file_name,
-                                                        lbs->el_index[j].file_name); j++)
-            lbs->el_index[j].offset += delta;
+            if (lbs->el_index[i].file_id == lbs->el_index[index].file_id &&
+                lbs->el_index[i].offset > old_offset)
+               lbs->el_index[i].offset += delta;
       }
 
       /* truncate file here */
@@ -5129,6 +7833,15 @@ int el_submit(LOGBOOK * lbs, int message_id, BOOL bedit, char *date, char attr_n
 
    close(fh);
 
+   sprintf(str, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
+   el_file_cache_drop(str);
+   el_entry_cache_invalidate(lbs, message_id);
+
+#ifdef HAVE_INOTIFY
+   /* index is up to date, ignore change notification of this file */
+   el_watch_ignore(str);
+#endif
+
    /* if reply, mark original message */
    reply_id = atoi(in_reply_to);
 
@@ -5226,20 +7939,18 @@ int el_delete_message(LOGBOOK * lbs, int message_id, BOOL delete_attachments,
 
  \********************************************************************/
 {
-   int i, index, size, fh, tail_size, old_offset;
+   int i, index, size, fh, tail_size, old_offset, file_id;
+   BOOL tombstone;
    char str[MAX_PATH_LENGTH], file_name[MAX_PATH_LENGTH], reply_to[MAX_REPLY_TO * 10], in_reply_to[256];
    char *buffer, *p;
    char *message, attachment_all[64 * MAX_ATTACHMENTS];
    char attrib[MAX_N_ATTR][NAME_LENGTH];
 
-   for (index = 0; index < *lbs->n_el_index; index++)
-      if (lbs->el_index[index].message_id == message_id)
-         break;
-
-   if (index == *lbs->n_el_index)
+   index = el_find_index(lbs, message_id);
+   if (index < 0)
       return -1;
 
-   sprintf(file_name, "%s%s%s", lbs->data_dir, lbs->el_index[index].subdir, lbs->el_index[index].file_name);
+   sprintf(file_name, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
    fh = open(file_name, O_RDWR | O_BINARY, 0644);
    if (fh < 0)
       return EL_FILE_ERROR;
@@ -5265,8 +7976,8 @@ int el_delete_message(LOGBOOK * lbs, int message_id, BOOL delete_attachments,
       close(fh);
       xfree(message);
 
-      /* file might have been edited, rebuild index */
-      el_build_index(lbs, TRUE);
+      /* file might have been edited, reindex it */
+      el_reindex_file(lbs, file_name);
       return el_delete_message(lbs, message_id, delete_attachments, attachment, delete_bw_ref,
                                delete_reply_to);
    }
@@ -5279,7 +7990,7 @@ int el_delete_message(LOGBOOK * lbs, int message_id, BOOL delete_attachments,
    }
 
    /* decode message size */
-   p = strstr(message + 8, "$@MID@$:");
+   p = el_next_record(message + 8);
    if (p == NULL)
       size = strlen(message);
    else
@@ -5326,23 +8037,31 @@ int el_delete_message(LOGBOOK * lbs, int message_id, BOOL delete_attachments,
    lseek(fh, 0, SEEK_END);
    tail_size = TELL(fh) - (lbs->el_index[index].offset + size);
 
-   buffer = NULL;
-   if (tail_size > 0) {
-      buffer = xmalloc(tail_size);
+   tombstone = (tail_size > 0 && el_append_only());
+   if (tombstone) {
+      /* leave following entries in place and mark this one as deleted */
+      lseek(fh, lbs->el_index[index].offset, SEEK_SET);
+      write(fh, EL_TOMBSTONE, 8);
+      el_file(lbs, index)->dead_size += size;
+   } else {
+      buffer = NULL;
+      if (tail_size > 0) {
+         buffer = xmalloc(tail_size);
+
+         lseek(fh, lbs->el_index[index].offset + size, SEEK_SET);
+         my_read(fh, buffer, tail_size);
+      }
+      lseek(fh, lbs->el_index[index].offset, SEEK_SET);
 
-      lseek(fh, lbs->el_index[index].offset + size, SEEK_SET);
-      my_read(fh, buffer, tail_size);
-   }
-   lseek(fh, lbs->el_index[index].offset, SEEK_SET);
+      if (tail_size > 0) {
+         write(fh, buffer, tail_size);
+         xfree(buffer);
+      }
 
-   if (tail_size > 0) {
-      write(fh, buffer, tail_size);
-      xfree(buffer);
+      /* truncate file here */
+      TRUNCATE(fh);
    }
 
-   /* truncate file here */
-   TRUNCATE(fh);
-
    /* if file length gets zero, delete file */
    tail_size = lseek(fh, 0, SEEK_END);
    close(fh);
@@ -5351,25 +8070,30 @@ int el_delete_message(LOGBOOK * lbs, int message_id, BOOL delete_attachments,
    if (tail_size == 0)
       remove(file_name);
 
+   el_file_cache_drop(file_name);
+   el_entry_cache_invalidate(lbs, message_id);
+#ifdef HAVE_INOTIFY
+   el_watch_ignore(file_name);
+#endif
+
    /* remove message from index */
-   strcpy(str, lbs->el_index[index].file_name);
+   el_thread_delete(lbs, index);
+   file_id = lbs->el_index[index].file_id;
    old_offset = lbs->el_index[index].offset;
    for (i = index; i < *lbs->n_el_index - 1; i++)
       memcpy(&lbs->el_index[i], &lbs->el_index[i + 1], sizeof(EL_INDEX));
 
-   (*lbs->n_el_index)--;
-   if (*lbs->n_el_index > 0)
-      lbs->el_index = xrealloc(lbs->el_index, sizeof(EL_INDEX) * (*lbs->n_el_index));
+   el_index_resize(lbs, *lbs->n_el_index - 1);
 
    /* correct all offsets after deleted message */
-   for (i = 0; i < *lbs->n_el_index; i++)
-      if (strieq(lbs->el_index[i].file_name, str) && lbs->el_index[i].offset > old_offset)
-         lbs->el_index[i].offset -= size;
+   if (!tombstone)
+      for (i = 0; i < *lbs->n_el_index; i++)
+         if (lbs->el_index[i].file_id == file_id && lbs->el_index[i].offset > old_offset)
+            lbs->el_index[i].offset -= size;
 
-   /* if other logbook has same index, update pointers */
-   for (i = 0; lb_list[i].name[0]; i++)
-      if (&lb_list[i] != lbs && lb_list[i].n_el_index == lbs->n_el_index)
-         lb_list[i].el_index = lbs->el_index;
+   /* positions of following messages have changed */
+   el_id_hash_rebuild(lbs);
+   el_share_index(lbs);
 
    /* delete also replies to this message */
    if (delete_reply_to && reply_to[0]) {
@@ -5415,7 +8139,7 @@ int el_correct_links(LOGBOOK * lbs, int old_id, int new_id)
 {
    int i, i1, n, n1, size;
       char date[80], *attrib, *text, in_reply_to[80], reply_to[MAX_REPLY_TO * 10], encoding[80],
-   locked_by[256], draft[256];
+   locked_by[256], draft[256], new_in_reply_to[80], new_reply_to[MAX_REPLY_TO * 10];
    char list[MAX_N_ATTR][NAME_LENGTH], list1[MAX_N_ATTR][NAME_LENGTH];
    char *att_file;
 
@@ -5423,11 +8147,13 @@ int el_correct_links(LOGBOOK * lbs, int old_id, int new_id)
    text = (char *) xmalloc(TEXT_SIZE);
    att_file = (char *) xmalloc(MAX_ATTACHMENTS * 256);
 
-   el_retrieve(lbs, new_id, date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, NULL, 0, in_reply_to,
-               reply_to, (char (*)[256]) att_file, encoding, locked_by, draft);
+   /* links of the new entry come from the index, only the linked entries get rewritten */
+   if (!el_attr_links(lbs, el_find_index(lbs, new_id), NULL, new_in_reply_to, new_reply_to, NULL))
+      el_retrieve(lbs, new_id, NULL, NULL, NULL, 0, NULL, 0, new_in_reply_to, new_reply_to, NULL, NULL, NULL,
+                  NULL);
 
    /* go through in_reply_to list */
-   n = strbreak(in_reply_to, list, MAX_N_ATTR, ",", FALSE);
+   n = strbreak(new_in_reply_to, list, MAX_N_ATTR, ",", FALSE);
    for (i = 0; i < n; i++) {
       size = TEXT_SIZE;
       el_retrieve(lbs, atoi(list[i]), date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, text, &size,
@@ -5450,13 +8176,10 @@ int el_correct_links(LOGBOOK * lbs, int old_id, int new_id)
                 in_reply_to, reply_to, encoding, (char (*)[256]) att_file, TRUE, locked_by, draft);
    }
 
-   el_retrieve(lbs, new_id, date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, NULL, 0, in_reply_to,
-               reply_to, (char (*)[256]) att_file, encoding, locked_by, draft);
-
    /* go through reply_to list */
-   n = strbreak(reply_to, list, MAX_N_ATTR, ",", FALSE);
+   n = strbreak(new_reply_to, list, MAX_N_ATTR, ",", FALSE);
    for (i = 0; i < n; i++) {
-      size = sizeof(text);
+      size = TEXT_SIZE;
       el_retrieve(lbs, atoi(list[i]), date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, text, &size,
                   in_reply_to, reply_to, (char (*)[256]) att_file, encoding, locked_by, draft);
 
@@ -6809,6 +9532,27 @@ void rsprintf(const char *format, ...)
 
 void flush_return_buffer()
 {
+   char str[20];
+
+   if (chunked_output) {
+      /* send as one chunk, the buffer is cleared only as far as it is used */
+      if (strlen_retbuf == 0)
+         return;
+      sprintf(str, "%X\r\n", strlen_retbuf);
+#ifdef HAVE_SSL
+      send_with_timeout(_ssl_con, _sock, str, strlen(str));
+      send_with_timeout(_ssl_con, _sock, return_buffer, strlen_retbuf);
+      send_with_timeout(_ssl_con, _sock, str + strlen(str) - 2, 2);
+#else
+      send_with_timeout(NULL, _sock, str, strlen(str));
+      send_with_timeout(NULL, _sock, return_buffer, strlen_retbuf);
+      send_with_timeout(NULL, _sock, str + strlen(str) - 2, 2);
+#endif
+      memset(return_buffer, 0, strlen_retbuf);
+      strlen_retbuf = 0;
+      return;
+   }
+
 #ifdef HAVE_SSL
    send_with_timeout(_ssl_con, _sock, return_buffer, strlen_retbuf);
 #else
@@ -6818,6 +9562,108 @@ void flush_return_buffer()
    strlen_retbuf = 0;
 }
 
+void start_chunked_output()
+/* send the HTTP header in the return buffer and continue with a chunked body, so that
+   long exports go out while they are produced instead of being collected in memory;
+   does nothing for HTTP/1.0 clients, which get the whole response at the end */
+{
+   char *p;
+   int header_length, length;
+
+   if (!http_1_1 || chunked_output)
+      return;
+
+   p = strstr(return_buffer, "\r\n\r\n");
+   if (p == NULL)
+      return;
+
+   header_length = (int) (p - return_buffer);
+   if (header_length + 100 > (int) sizeof(header_buffer))
+      return;
+   memcpy(header_buffer, return_buffer, header_length);
+   sprintf(header_buffer + header_length, "\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+           keep_alive ? "" : "Connection: Close\r\n");
+#ifdef HAVE_SSL
+   send_with_timeout(_ssl_con, _sock, header_buffer, strlen(header_buffer));
+#else
+   send_with_timeout(NULL, _sock, header_buffer, strlen(header_buffer));
+#endif
+
+   /* keep what follows the header as start of the first chunk */
+   length = strlen_retbuf - header_length - 4;
+   memmove(return_buffer, p + 4, length);
+   memset(return_buffer + length, 0, strlen_retbuf - length);
+   strlen_retbuf = length;
+   chunked_output = TRUE;
+}
+
+void end_chunked_output()
+/* send the rest of the return buffer and the last chunk, nothing is left for send_return() */
+{
+   char str[10];
+
+   if (!chunked_output)
+      return;
+
+   flush_return_buffer();
+   strcpy(str, "0\r\n\r\n");
+#ifdef HAVE_SSL
+   send_with_timeout(_ssl_con, _sock, str, 5);
+#else
+   send_with_timeout(NULL, _sock, str, 5);
+#endif
+   chunked_output = FALSE;
+}
+
+void reap_request_children()
+/* collect child processes of fork_request() which have finished */
+{
+#ifdef OS_UNIX
+   while (n_request_child > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+      n_request_child--;
+#endif
+}
+
+BOOL fork_request()
+/* Finish the current request in a child process if "List processes" allows it, so that
+   long list displays and searches do not block other requests. The child works on a
+   copy of the index taken at the fork, while changes to logbooks stay in the server
+   process one at a time. Returns TRUE in the server process, which then drops the
+   connection, and FALSE in the child or if no child could be started. */
+{
+#ifdef OS_UNIX
+   char str[80];
+   pid_t pid;
+
+   if (request_child)
+      return FALSE;
+
+   if (!getcfg("global", "List processes", str, sizeof(str)) || atoi(str) <= 0)
+      return FALSE;
+
+   reap_request_children();
+   if (n_request_child >= atoi(str))
+      return FALSE;
+
+   pid = fork();
+   if (pid < 0)
+      return FALSE;
+
+   if (pid == 0) {
+      /* the child serves this request only */
+      request_child = TRUE;
+      keep_alive = FALSE;
+      return FALSE;
+   }
+
+   n_request_child++;
+   request_forked = TRUE;
+   return TRUE;
+#else
+   return FALSE;
+#endif
+}
+
 /*------------------------------------------------------------------*/
 
 /* Parameter handling functions similar to setenv/getenv */
@@ -7593,7 +10439,7 @@ void show_plain_header(int size, char *file_name)
    /* header */
    rsprintf("HTTP/1.1 200 Document follows\r\n");
    rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
-   rsprintf("Accept-Ranges: bytes\r\n");
+   rsprintf("Accept-Ranges: none\r\n");
 
    if (keep_alive) {
       rsprintf("Connection: Keep-Alive\r\n");
@@ -8486,21 +11332,142 @@ int exist_file(char *file_name)
 
 /*------------------------------------------------------------------*/
 
+static int range_number(const char **p, int *value)
+/* read decimal number of a byte range, larger values than fit are clipped */
+{
+   int n;
+
+   for (n = 0, *value = 0; isdigit((unsigned char) **p); (*p)++, n++)
+      *value = *value > (INT_MAX - 9) / 10 ? INT_MAX : *value * 10 + (**p - '0');
+
+   return n;
+}
+
+int parse_range(int size, const char *etag)
+/* evaluate "Range" and "If-Range" of the request for a file of given size and put the
+   parts to send into return_range[]; return their number, 0 if the whole file is sent or
+   -1 if none of the ranges lies inside the file */
+{
+   int n, n_spec, first, last;
+   const char *p;
+
+   /* a range of a different version of the file cannot be used */
+   if (!http_range[0] || (http_if_range[0] && strcmp(http_if_range, etag) != 0))
+      return 0;
+
+   p = http_range;
+   while (*p == ' ')
+      p++;
+   if (!strnieq(p, "bytes", 5))
+      return 0;
+   p += 5;
+   while (*p == ' ')
+      p++;
+   if (*p++ != '=')
+      return 0;
+
+   for (n = n_spec = 0;; p++) {
+      while (*p == ' ' || *p == '\t')
+         p++;
+
+      /* skip empty list elements */
+      if (*p == 0)
+         break;
+      if (*p == ',')
+         continue;
+
+      if (*p == '-') {
+         /* last bytes of file */
+         p++;
+         if (range_number(&p, &last) == 0)
+            return 0;
+         first = last < size ? size - last : 0;
+         if (last == 0)
+            first = size;
+         last = size - 1;
+      } else {
+         if (range_number(&p, &first) == 0 || *p != '-')
+            return 0;
+         p++;
+         if (range_number(&p, &last) == 0)
+            last = size - 1;
+         else if (last < first)
+            return 0;
+         if (last > size - 1)
+            last = size - 1;
+      }
+      n_spec++;
+
+      /* ranges starting beyond the end of the file are dropped */
+      if (first < size) {
+         if (n == N_MAX_RANGE)
+            return 0;
+         return_range[n][0] = first;
+         return_range[n][1] = last - first + 1;
+         n++;
+      }
+
+      while (*p == ' ' || *p == '\t')
+         p++;
+      if (*p == 0)
+         break;
+      if (*p != ',')
+         return 0;
+   }
+
+   if (n_spec == 0)
+      return 0;
+
+   return n > 0 ? n : -1;
+}
+
+void range_part_header(char *str, int i)
+/* header in front of part i of multipart/byteranges response */
+{
+   sprintf(str, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %d-%d/%d\r\n\r\n",
+           return_boundary, return_range_type, return_range[i][0],
+           return_range[i][0] + return_range[i][1] - 1, return_file_size);
+}
+
+/*------------------------------------------------------------------*/
+
 void send_file_direct(char *file_name)
 {
-   int fh, i, length, delta;
-   char str[MAX_PATH_LENGTH], dir[MAX_PATH_LENGTH], charset[80];
+   int fh, i, length, n_range;
+   char str[MAX_PATH_LENGTH + 256], dir[MAX_PATH_LENGTH], charset[80], etag[80];
+   struct stat st;
 
    getcwd(dir, sizeof(dir));
    fh = open(file_name, O_RDONLY | O_BINARY);
    if (fh > 0) {
-      lseek(fh, 0, SEEK_END);
-      length = TELL(fh);
-      lseek(fh, 0, SEEK_SET);
+      fstat(fh, &st);
+      length = (int) st.st_size;
+
+      /* the tag changes with the file, so that a resumed download does not mix versions */
+      sprintf(etag, "\"%x-%x\"", length, (unsigned int) st.st_mtime);
+      n_range = parse_range(length, etag);
+
+      if (n_range == -1) {
+         close(fh);
+         rsprintf("HTTP/1.1 416 Range Not Satisfiable\r\n");
+         rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
+         if (keep_alive) {
+            rsprintf("Connection: Keep-Alive\r\n");
+            rsprintf("Keep-Alive: timeout=60, max=10\r\n");
+         }
+         rsprintf("Content-Range: bytes */%d\r\n", length);
+         rsprintf("Content-Length: 0\r\n\r\n");
+         return_length = strlen_retbuf;
+         return;
+      }
 
-      rsprintf("HTTP/1.1 200 Document follows\r\n");
+      if (n_range > 0)
+         rsprintf("HTTP/1.1 206 Partial Content\r\n");
+      else
+         rsprintf("HTTP/1.1 200 Document follows\r\n");
       rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
       rsprintf("Accept-Ranges: bytes\r\n");
+      rsprintf("ETag: %s\r\n", etag);
 
       /* set expiration time to one day if no thumbnail */
       if (isparam("thumb")) {
@@ -8529,29 +11496,43 @@ void send_file_direct(char *file_name)
 
       if (filetype[i].ext[0]) {
          if (strncmp(filetype[i].type, "text", 4) == 0)
-            rsprintf("Content-Type: %s;charset=%s\r\n", filetype[i].type, charset);
+            sprintf(return_range_type, "%s;charset=%s", filetype[i].type, charset);
          else
-            rsprintf("Content-Type: %s\r\n", filetype[i].type);
+            strlcpy(return_range_type, filetype[i].type, sizeof(return_range_type));
       } else if (is_ascii(file_name))
-         rsprintf("Content-Type: text/plain;charset=%s\r\n", charset);
+         sprintf(return_range_type, "text/plain;charset=%s", charset);
       else
-         rsprintf("Content-Type: application/octet-stream;charset=%s\r\n", charset);
-
-      rsprintf("Content-Length: %d\r\n\r\n", length);
+         sprintf(return_range_type, "application/octet-stream;charset=%s", charset);
 
-      /* increase return buffer size if file too big */
-      if (length > return_buffer_size - (int) strlen(return_buffer)) {
-         delta = length - (return_buffer_size - strlen(return_buffer)) + 1000;
-
-         return_buffer = xrealloc(return_buffer, return_buffer_size + delta);
-         memset(return_buffer + return_buffer_size, 0, delta);
-         return_buffer_size += delta;
+      return_file_size = length;
+      if (n_range == 0) {
+         n_return_range = 1;
+         return_range[0][0] = 0;
+         return_range[0][1] = length;
+      } else
+         n_return_range = n_range;
+
+      if (n_return_range == 1) {
+         rsprintf("Content-Type: %s\r\n", return_range_type);
+         if (n_range > 0)
+            rsprintf("Content-Range: bytes %d-%d/%d\r\n", return_range[0][0],
+                     return_range[0][0] + return_range[0][1] - 1, length);
+         rsprintf("Content-Length: %d\r\n\r\n", return_range[0][1]);
+      } else {
+         /* several ranges are sent as parts of a multipart/byteranges body */
+         sprintf(return_boundary, "ELOG_BYTERANGES_%08X%08X", rand(), (unsigned int) time(NULL));
+         for (i = length = 0; i < n_return_range; i++) {
+            range_part_header(str, i);
+            length += strlen(str) + return_range[i][1];
+         }
+         length += strlen(return_boundary) + 8;
+         rsprintf("Content-Type: multipart/byteranges; boundary=%s\r\n", return_boundary);
+         rsprintf("Content-Length: %d\r\n\r\n", length);
       }
 
-      return_length = strlen(return_buffer) + length;
-      read(fh, return_buffer + strlen(return_buffer), length);
-
-      close(fh);
+      /* file is sent by send_return() after the header */
+      return_length = strlen(return_buffer);
+      return_file = fh;
    } else {
       char encodedname[256];
       show_html_header(NULL, FALSE, "404 Not Found", TRUE, FALSE, NULL, FALSE, 0);
@@ -9992,11 +12973,8 @@ void show_edit_form(LOGBOOK * lbs, int message_id, BOOL breply, BOOL bedit, BOOL
 
    /* check for editing interval */
    if (bedit && getcfg(lbs->name, "Restrict edit time", str, sizeof(str))) {
-      for (i = 0; i < *lbs->n_el_index; i++)
-         if (lbs->el_index[i].message_id == message_id)
-            break;
-
-      if (i < *lbs->n_el_index && time(NULL) > lbs->el_index[i].file_time + atof(str) * 3600) {
+      i = el_find_index(lbs, message_id);
+      if (i >= 0 && time(NULL) > lbs->el_index[i].file_time + atof(str) * 3600) {
          sprintf(str, loc("Entry can only be edited %1.2lg hours after creation"), atof(str));
          show_error(str);
          xfree(text);
@@ -14377,11 +17355,8 @@ void show_elog_delete(LOGBOOK * lbs, int message_id)
 
    /* check for editing interval */
    if (getcfg(lbs->name, "Restrict edit time", str, sizeof(str))) {
-      for (i = 0; i < *lbs->n_el_index; i++)
-         if (lbs->el_index[i].message_id == message_id)
-            break;
-
-      if (i < *lbs->n_el_index && time(NULL) > lbs->el_index[i].file_time + atof(str) * 3600) {
+      i = el_find_index(lbs, message_id);
+      if (i >= 0 && time(NULL) > lbs->el_index[i].file_time + atof(str) * 3600) {
          sprintf(str, loc("Entry can only be deleted %1.2lg hours after creation"), atof(str));
          show_error(str);
          return;
@@ -14724,7 +17699,7 @@ void show_logbook_new(LOGBOOK * lbs)
 int show_download_page(LOGBOOK * lbs, char *path)
 {
    char file_name[256], error_str[256];
-   int index, message_id, fh, i, size, delta;
+   int index, message_id, i, size, delta;
    char message[TEXT_SIZE + 1000], *p, *buffer;
 
    if (stricmp(path, "gbl") == 0) {
@@ -14763,32 +17738,21 @@ int show_download_page(LOGBOOK * lbs, char *path)
 
          if (message_id == -1)
             index = *lbs->n_el_index - 1;  // last entry
-         else {
-            for (index = 0; index < *lbs->n_el_index; index++)
-               if (lbs->el_index[index].message_id == message_id)
-                  break;
-         }
+         else
+            index = el_find_index(lbs, message_id);
 
-         if (index == *lbs->n_el_index)
+         if (index < 0)
             return EL_NO_MSG;
 
-         sprintf(file_name, "%s%s%s", lbs->data_dir, lbs->el_index[index].subdir, lbs->el_index[index].file_name);
-         fh = open(file_name, O_RDWR | O_BINARY, 0644);
-         if (fh < 0)
-            return EL_FILE_ERROR;
-
-         lseek(fh, lbs->el_index[index].offset, SEEK_SET);
-         i = my_read(fh, message, sizeof(message) - 1);
-         if (i <= 0) {
-            close(fh);
+         sprintf(file_name, "%s%s%s", lbs->data_dir, el_file(lbs, index)->subdir, el_file(lbs, index)->file_name);
+         buffer = el_file_cache_get(file_name, &i);
+         if (buffer == NULL || lbs->el_index[index].offset >= i)
             return EL_FILE_ERROR;
-         }
 
-         message[i] = 0;
-         close(fh);
+         strlcpy(message, buffer + lbs->el_index[index].offset, sizeof(message));
 
          /* decode message size */
-         p = strstr(message + 8, "$@MID@$:");
+         p = el_next_record(message + 8);
          if (p == NULL)
             size = strlen(message);
          else
@@ -15584,13 +18548,8 @@ void xml_import(LOGBOOK * lbs, const char *xml, const char *xmlfile)
             p = str;
 
          bedit = FALSE;
-         if (isparam("keep")) {
-            for (i = 0; i < *lbs->n_el_index; i++)
-               if (lbs->el_index[i].message_id == message_id)
-                  break;
-            if (lbs->el_index[i].message_id == message_id)
-               bedit = TRUE;
-         }
+         if (isparam("keep") && el_find_index(lbs, message_id) >= 0)
+            bedit = TRUE;
 
          /* submit entry */
          if (el_submit
@@ -15625,7 +18584,7 @@ int show_md5_page(LOGBOOK * lbs)
    /* header */
    rsprintf("HTTP/1.1 200 Document follows\r\n");
    rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
-   rsprintf("Accept-Ranges: bytes\r\n");
+   rsprintf("Accept-Ranges: none\r\n");
    rsprintf("Connection: close\r\n");
    rsprintf("Content-Type: text/plain;charset=%s\r\n", DEFAULT_HTTP_CHARSET);
    rsprintf("Pragma: no-cache\r\n");
@@ -17387,11 +20346,7 @@ void synchronize_logbook(LOGBOOK * lbs, int mode, BOOL sync_all)
 
             message_id = md5_remote[i_remote].message_id;
 
-            for (i_msg = 0; i_msg < *lbs->n_el_index; i_msg++)
-               if (message_id == lbs->el_index[i_msg].message_id)
-                  break;
-
-            if (i_msg == *lbs->n_el_index) {
+            if (el_find_index(lbs, message_id) < 0) {
 
                for (i_cache = 0; i_cache < n_cache; i_cache++)
                   if (md5_cache[i_cache].message_id == message_id)
@@ -18523,7 +21478,7 @@ void display_reply(LOGBOOK * lbs, int message_id, int printable, int expand, int
    attrib = (char *) xmalloc(MAX_N_ATTR * NAME_LENGTH);
    date = (char *) xmalloc(80);
    in_reply_to = (char *) xmalloc(80);
-   reply_to = (char *) xmalloc(256);
+   reply_to = (char *) xmalloc(MAX_REPLY_TO * 10);
    encoding = (char *) xmalloc(80);
    locked_by = (char *) xmalloc(256);
    draft = (char *) xmalloc(256);
@@ -18531,10 +21486,16 @@ void display_reply(LOGBOOK * lbs, int message_id, int printable, int expand, int
    if (draft == NULL)
       return;
 
+   /* drafts are not displayed, so do not read them */
    reply_to[0] = 0;
-   size = TEXT_SIZE;
-   status = el_retrieve(lbs, message_id, date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, text, &size,
-                        in_reply_to, reply_to, (char (*)[256]) attachment, encoding, locked_by, draft);
+   if (el_attr_links(lbs, el_find_index(lbs, message_id), NULL, NULL, NULL, draft) && draft[0])
+      status = EL_SUCCESS;
+   else {
+      size = TEXT_SIZE;
+      status = el_retrieve(lbs, message_id, date, attr_list, (char (*)[1500]) attrib, lbs->n_attr, text,
+                           &size, in_reply_to, reply_to, (char (*)[256]) attachment, encoding, locked_by,
+                           draft);
+   }
 
    if (status != EL_SUCCESS || draft[0]) {
       xfree(text);
@@ -18549,55 +21510,297 @@ void display_reply(LOGBOOK * lbs, int message_id, int printable, int expand, int
       return;
    }
 
-   display_line(lbs, message_id, 0, "threaded", expand, level, printable, n_line, FALSE, FALSE, date,
-                in_reply_to, reply_to, n_attr_disp, disp_attr, NULL, (char (*)[1500]) attrib, lbs->n_attr,
-                text, show_text, (char (*)[256]) attachment, encoding, 0, NULL, locked_by, highlight,
-                &re_buf[0], highlight_mid, absolute_link, draft);
+   display_line(lbs, message_id, 0, "threaded", expand, level, printable, n_line, FALSE, FALSE, date,
+                in_reply_to, reply_to, n_attr_disp, disp_attr, NULL, (char (*)[1500]) attrib, lbs->n_attr,
+                text, show_text, (char (*)[256]) attachment, encoding, 0, NULL, locked_by, highlight,
+                &re_buf[0], highlight_mid, absolute_link, draft);
+
+   if (reply_to[0]) {
+      p = reply_to;
+      do {
+         display_reply(lbs, atoi(p), printable, expand, n_line, n_attr_disp, disp_attr, show_text, level + 1,
+                       highlight, &re_buf[0], highlight_mid, absolute_link);
+
+         while (*p && isdigit(*p))
+            p++;
+         while (*p && (*p == ',' || *p == ' '))
+            p++;
+      } while (*p);
+   }
+
+   xfree(text);
+   xfree(attachment);
+   xfree(attrib);
+   xfree(date);
+   xfree(in_reply_to);
+   xfree(reply_to);
+   xfree(encoding);
+   xfree(locked_by);
+   xfree(draft);
+}
+
+/*------------------------------------------------------------------*/
+
+/* Sorting by attributes uses a list of keys, parsed once per request from the sort
+   parameter or "Sort Attributes". Every entry gets one value per key, a number for
+   numeric keys or the offset of its strxfrm() collation string in a pool for text
+   keys, so entries are compared without config lookups, string building or truncation. */
+
+#define SORT_ID      -1
+#define SORT_LOGBOOK -2
+#define SORT_DATE    -3
+
+typedef struct {
+   int attr;                    /* attribute index or SORT_ID, SORT_LOGBOOK, SORT_DATE */
+   BOOL numeric;
+} SORT_KEY;
+
+static struct {
+   int n_key;
+   SORT_KEY key[MAX_N_ATTR + 3];
+   char *pool;
+   int pool_size, pool_used;
+} msg_sort;
+
+static void msg_sort_add_key(int attr, BOOL numeric)
+{
+   if (msg_sort.n_key < MAX_N_ATTR + 3) {
+      msg_sort.key[msg_sort.n_key].attr = attr;
+      msg_sort.key[msg_sort.n_key].numeric = numeric;
+      msg_sort.n_key++;
+   }
+}
+
+int msg_sort_init(LOGBOOK * lbs, char *sort_item)
+/* get sort keys from sort item or from "Sort Attributes" of logbook, return number of keys */
+{
+   int i, j, n;
+   char *list, name[MAX_N_ATTR][NAME_LENGTH];
+
+   msg_sort.n_key = 0;
+   msg_sort.pool = NULL;
+   msg_sort.pool_size = msg_sort.pool_used = 0;
+
+   if (sort_item[0]) {
+      if (strieq(sort_item, loc("ID")))
+         msg_sort_add_key(SORT_ID, TRUE);
+      else if (strieq(sort_item, loc("Logbook")))
+         msg_sort_add_key(SORT_LOGBOOK, FALSE);
+      else
+         for (i = 0; i < lbs->n_attr; i++)
+            if (strieq(sort_item, attr_list[i])) {
+               msg_sort_add_key(i, (attr_flags[i] & (AF_NUMERIC | AF_DATETIME | AF_DATE)) > 0);
+               break;
+            }
+
+      if (msg_sort.n_key)
+         return msg_sort.n_key;
+   }
+
+   list = xmalloc(10000);
+   if (getcfg(lbs->name, "Sort Attributes", list, 10000)) {
+      n = strbreak(list, name, MAX_N_ATTR, ",", FALSE);
+      for (i = 0; i < n; i++) {
+         for (j = 0; j < lbs->n_attr; j++)
+            if (strieq(name[i], attr_list[j])) {
+               msg_sort_add_key(j, (attr_flags[j] & (AF_NUMERIC | AF_DATETIME | AF_DATE)) > 0);
+               break;
+            }
+
+         if (strieq(name[i], loc("ID")))
+            msg_sort_add_key(SORT_ID, TRUE);
+         else if (strieq(name[i], loc("Logbook")))
+            msg_sort_add_key(SORT_LOGBOOK, FALSE);
+         else if (strieq(name[i], loc("Date")))
+            msg_sort_add_key(SORT_DATE, TRUE);
+      }
+   }
+   xfree(list);
+
+   return msg_sort.n_key;
+}
+
+static int msg_sort_string(char *str)
+/* put collation string of str into pool, return its offset */
+{
+   int size, offset;
+
+   size = (int) strxfrm(NULL, str, 0) + 1;
+   if (msg_sort.pool_used + size > msg_sort.pool_size) {
+      msg_sort.pool_size = 2 * msg_sort.pool_size + size + 1000;
+      msg_sort.pool = xrealloc(msg_sort.pool, msg_sort.pool_size);
+   }
+
+   offset = msg_sort.pool_used;
+   strxfrm(msg_sort.pool + offset, str, size);
+   msg_sort.pool_used += size;
+
+   return offset;
+}
+
+void msg_sort_set(MSG_LIST * msg, MSG_KEY * key, int message_id, char *date, char attrib[MAX_N_ATTR][NAME_LENGTH])
+/* set the sort keys of an entry */
+{
+   int i;
+   SORT_KEY *k;
+
+   msg->key = key;
+   for (i = 0; i < msg_sort.n_key; i++) {
+      k = &msg_sort.key[i];
+      if (k->attr == SORT_ID)
+         key[i].number = message_id;
+      else if (k->attr == SORT_DATE)
+         key[i].number = (double) date_to_ltime(date);
+      else if (k->attr == SORT_LOGBOOK)
+         key[i].string = msg_sort_string(msg->lbs->name);
+      else if (k->numeric)
+         key[i].number = atof(attrib[k->attr]);
+      else
+         key[i].string = msg_sort_string(attrib[k->attr]);
+   }
+}
+
+void msg_sort_free()
+{
+   xfree(msg_sort.pool);
+   msg_sort.pool = NULL;
+   msg_sort.pool_size = msg_sort.pool_used = 0;
+   msg_sort.n_key = 0;
+}
 
-   if (reply_to[0]) {
-      p = reply_to;
-      do {
-         display_reply(lbs, atoi(p), printable, expand, n_line, n_attr_disp, disp_attr, show_text, level + 1,
-                       highlight, &re_buf[0], highlight_mid, absolute_link);
+static int msg_compare_key(MSG_LIST * m1, MSG_LIST * m2)
+{
+   int i, c;
 
-         while (*p && isdigit(*p))
-            p++;
-         while (*p && (*p == ',' || *p == ' '))
-            p++;
-      } while (*p);
+   for (i = 0; i < msg_sort.n_key; i++) {
+      if (msg_sort.key[i].numeric) {
+         if (m1->key[i].number != m2->key[i].number)
+            return m1->key[i].number < m2->key[i].number ? -1 : 1;
+      } else {
+         c = strcmp(msg_sort.pool + m1->key[i].string, msg_sort.pool + m2->key[i].string);
+         if (c)
+            return c;
+      }
    }
 
-   xfree(text);
-   xfree(attachment);
-   xfree(attrib);
-   xfree(date);
-   xfree(in_reply_to);
-   xfree(reply_to);
-   xfree(encoding);
-   xfree(locked_by);
-   xfree(draft);
+   return 0;
 }
 
-/*------------------------------------------------------------------*/
+static int msg_compare_tie(MSG_LIST * m1, MSG_LIST * m2)
+/* order entries with equal keys by ID and logbook in either direction, since qsort()
+   is not stable and a page must show the same entries as the full list */
+{
+   int id1, id2;
+
+   id1 = m1->lbs->el_index[m1->index].message_id;
+   id2 = m2->lbs->el_index[m2->index].message_id;
+   if (id1 != id2)
+      return id1 < id2 ? -1 : 1;
+
+   return m1->lbs == m2->lbs ? 0 : m1->lbs < m2->lbs ? -1 : 1;
+}
 
 int msg_compare(const void *m1, const void *m2)
 {
-   return strcoll(((MSG_LIST *) m1)->string, ((MSG_LIST *) m2)->string);
+   int c;
+
+   c = msg_compare_key((MSG_LIST *) m1, (MSG_LIST *) m2);
+   return c ? c : msg_compare_tie((MSG_LIST *) m1, (MSG_LIST *) m2);
 }
 
 int msg_compare_reverse(const void *m1, const void *m2)
 {
-   return strcoll(((MSG_LIST *) m2)->string, ((MSG_LIST *) m1)->string);
+   int c;
+
+   c = msg_compare_key((MSG_LIST *) m2, (MSG_LIST *) m1);
+   return c ? c : msg_compare_tie((MSG_LIST *) m1, (MSG_LIST *) m2);
 }
 
 int msg_compare_numeric(const void *m1, const void *m2)
 {
-   return ((MSG_LIST *) m1)->number - ((MSG_LIST *) m2)->number;
+   int c;
+
+   c = ((MSG_LIST *) m1)->number - ((MSG_LIST *) m2)->number;
+   return c ? c : msg_compare_tie((MSG_LIST *) m1, (MSG_LIST *) m2);
 }
 
 int msg_compare_reverse_numeric(const void *m1, const void *m2)
 {
-   return ((MSG_LIST *) m2)->number - ((MSG_LIST *) m1)->number;
+   int c;
+
+   c = ((MSG_LIST *) m2)->number - ((MSG_LIST *) m1)->number;
+   return c ? c : msg_compare_tie((MSG_LIST *) m1, (MSG_LIST *) m2);
+}
+
+static int msg_order(MSG_LIST * msg_list, int i1, int i2, int (*compare) (const void *, const void *))
+/* compare two entries of the message list, entries the comparison cannot tell apart keep
+   their order in the list */
+{
+   int c;
+
+   c = compare(&msg_list[i1], &msg_list[i2]);
+   return c ? c : i1 - i2;
+}
+
+static void msg_partial_sort(MSG_LIST * msg_list, int *perm, int left, int right, int lo, int hi,
+                             int (*compare) (const void *, const void *))
+/* quicksort perm[left..right] only as far as needed to get perm[lo..hi] in order */
+{
+   int i, m, p, tmp;
+
+#define MSG_SWAP(a, b) { tmp = perm[a]; perm[a] = perm[b]; perm[b] = tmp; }
+
+   while (left < right && left <= hi && right >= lo) {
+      /* median of three as pivot, which keeps already sorted lists fast */
+      m = left + (right - left) / 2;
+      if (msg_order(msg_list, perm[m], perm[left], compare) < 0)
+         MSG_SWAP(m, left);
+      if (msg_order(msg_list, perm[right], perm[left], compare) < 0)
+         MSG_SWAP(right, left);
+      if (msg_order(msg_list, perm[right], perm[m], compare) < 0)
+         MSG_SWAP(right, m);
+      MSG_SWAP(m, right);
+
+      for (i = p = left; i < right; i++)
+         if (msg_order(msg_list, perm[i], perm[right], compare) < 0) {
+            MSG_SWAP(i, p);
+            p++;
+         }
+      MSG_SWAP(p, right);
+
+      /* recurse into the smaller part to limit the stack depth */
+      if (p - left < right - p) {
+         msg_partial_sort(msg_list, perm, left, p - 1, lo, hi, compare);
+         left = p + 1;
+      } else {
+         msg_partial_sort(msg_list, perm, p + 1, right, lo, hi, compare);
+         right = p - 1;
+      }
+   }
+
+#undef MSG_SWAP
+}
+
+void msg_select(MSG_LIST * msg_list, int n_msg, int i_start, int i_stop, int (*compare) (const void *, const void *))
+/* put the entries a stable sort of the message list would place at i_start..i_stop there,
+   in O(n_msg) instead of sorting the whole list; other positions become undefined */
+{
+   int i, *perm;
+   MSG_LIST *page;
+
+   perm = (int *) xmalloc(sizeof(int) * n_msg);
+   for (i = 0; i < n_msg; i++)
+      perm[i] = i;
+
+   msg_partial_sort(msg_list, perm, 0, n_msg - 1, i_start, i_stop, compare);
+
+   page = (MSG_LIST *) xmalloc(sizeof(MSG_LIST) * (i_stop - i_start + 1));
+   for (i = i_start; i <= i_stop; i++)
+      memcpy(&page[i - i_start], &msg_list[perm[i]], sizeof(MSG_LIST));
+   memcpy(&msg_list[i_start], page, sizeof(MSG_LIST) * (i_stop - i_start + 1));
+
+   xfree(page);
+   xfree(perm);
 }
 
 /*------------------------------------------------------------------*/
@@ -19918,6 +23121,206 @@ void show_rss_feed(LOGBOOK * lbs)
 
 /*------------------------------------------------------------------*/
 
+/* Compiled regular expressions of list filters are kept across requests,
+   since pages with automatic refresh send the same filters again and
+   again. The least recently used one is replaced when the cache is full,
+   which holds more than the MAX_N_ATTR + 1 expressions of one request. */
+
+#define N_REGEX_CACHE 128
+
+typedef struct {
+   char *pattern;
+   int flags;
+   regex_t re;
+   int last_used;
+   int literal;                 /* length of pattern without special characters, else 0 */
+} EL_CACHED_REGEX;
+
+typedef struct {
+   EL_CACHED_REGEX entry[N_REGEX_CACHE];
+   int clock;
+   int hits, misses;
+   int reported_hits, reported_misses;
+} EL_REGEX_CACHE;
+
+EL_REGEX_CACHE el_regex_cache;
+
+int el_regcomp(regex_t * preg, const char *pattern, int flags)
+/* like regcomp(), but take the expression from the cache if it was compiled before;
+   preg stays owned by the cache and must not be passed to regfree() */
+{
+   EL_CACHED_REGEX *c, *lru;
+   int i, status;
+
+   lru = &el_regex_cache.entry[0];
+   for (i = 0; i < N_REGEX_CACHE; i++) {
+      c = &el_regex_cache.entry[i];
+      if (c->pattern && c->flags == flags && strcmp(c->pattern, pattern) == 0) {
+         memcpy(preg, &c->re, sizeof(regex_t));
+         c->last_used = ++el_regex_cache.clock;
+         el_regex_cache.hits++;
+         return 0;
+      }
+      if (lru->pattern && (c->pattern == NULL || c->last_used < lru->last_used))
+         lru = c;
+   }
+
+   el_regex_cache.misses++;
+   status = regcomp(preg, pattern, flags);
+   if (status)
+      return status;
+
+   if (lru->pattern) {
+      regfree(&lru->re);
+      xfree(lru->pattern);
+   }
+   lru->pattern = xstrdup(pattern);
+   lru->flags = flags;
+   memcpy(&lru->re, preg, sizeof(regex_t));
+   lru->last_used = ++el_regex_cache.clock;
+
+   /* plain words are searched by el_regexec() without the regex matcher */
+   lru->literal = (flags & REG_EXTENDED) && strpbrk(pattern, "\\.[]()*+?{}|^$") == NULL ?
+       (int) strlen(pattern) : 0;
+
+   return 0;
+}
+
+static BOOL el_literal_at(const unsigned char *s, const unsigned char *pattern, int len,
+                          const unsigned char *translate)
+{
+   int i;
+
+   if (translate == NULL)
+      return memcmp(s, pattern, len) == 0;
+
+   for (i = 0; i < len; i++)
+      if (translate[s[i]] != translate[pattern[i]])
+         return FALSE;
+
+   return TRUE;
+}
+
+static int el_literal_search(const char *str, const char *pattern, int len, const unsigned char *translate)
+/* return offset of first occurrence of pattern in str, compared through the case folding
+   table of the regex if not NULL, or -1 */
+{
+   const unsigned char *s, *p;
+   unsigned char first[2], last[2];
+   int i, n, n_first, n_last;
+
+   s = (const unsigned char *) str;
+   p = (const unsigned char *) pattern;
+   n = strlen(str);
+   if (n < len)
+      return -1;
+
+   /* bytes which fold to the first and last character of the pattern */
+   first[0] = first[1] = p[0];
+   last[0] = last[1] = p[len - 1];
+   n_first = n_last = 1;
+   if (translate) {
+      n_first = n_last = 0;
+      for (i = 0; i < 256; i++) {
+         if (translate[i] == translate[p[0]] && n_first++ < 2)
+            first[n_first - 1] = i;
+         if (translate[i] == translate[p[len - 1]] && n_last++ < 2)
+            last[n_last - 1] = i;
+      }
+      if (n_first == 1)
+         first[1] = first[0];
+      if (n_last == 1)
+         last[1] = last[0];
+   }
+
+   i = 0;
+
+#ifdef __SSE2__
+   /* compare 16 positions at once with first and last character of the pattern,
+      and check the full pattern only where both match */
+   if (n_first <= 2 && n_last <= 2) {
+      __m128i f0, f1, l0, l1, a, b;
+      int mask, bit;
+
+      f0 = _mm_set1_epi8((char) first[0]);
+      f1 = _mm_set1_epi8((char) first[1]);
+      l0 = _mm_set1_epi8((char) last[0]);
+      l1 = _mm_set1_epi8((char) last[1]);
+
+      for (; i + len - 1 + 16 <= n; i += 16) {
+         a = _mm_loadu_si128((const __m128i *) (s + i));
+         b = _mm_loadu_si128((const __m128i *) (s + i + len - 1));
+         mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1)),
+                                                _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1))));
+         for (bit = 0; mask; bit++, mask >>= 1)
+            if ((mask & 1) && el_literal_at(s + i + bit, p, len, translate))
+               return i + bit;
+      }
+   }
+#endif
+
+   for (; i + len <= n; i++)
+      if ((translate ? translate[s[i]] == translate[p[0]] : s[i] == p[0]) &&
+          el_literal_at(s + i, p, len, translate))
+         return i;
+
+   return -1;
+}
+
+int el_regexec(regex_t * preg, const char *str, size_t nmatch, regmatch_t pmatch[], int eflags)
+/* like regexec() for expressions from el_regcomp(), plain words are found by a substring
+   search which gives the same match as the regex */
+{
+   EL_CACHED_REGEX *c;
+   int i, offset;
+
+   c = NULL;
+   for (i = 0; i < N_REGEX_CACHE; i++)
+      if (el_regex_cache.entry[i].pattern && el_regex_cache.entry[i].re.buffer == preg->buffer) {
+         c = &el_regex_cache.entry[i];
+         break;
+      }
+
+   if (c == NULL || c->literal == 0)
+      return regexec(preg, str, nmatch, pmatch, eflags);
+
+   offset = el_literal_search(str, c->pattern, c->literal, (const unsigned char *) preg->translate);
+   if (offset < 0)
+      return REG_NOMATCH;
+
+   for (i = 0; i < (int) nmatch; i++)
+      pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+   if (nmatch > 0) {
+      pmatch[0].rm_so = offset;
+      pmatch[0].rm_eo = offset + c->literal;
+   }
+
+   return 0;
+}
+
+void el_regex_cache_report()
+/* show cache statistics if they changed since the last call */
+{
+   int i, n;
+
+   if (el_regex_cache.hits == el_regex_cache.reported_hits &&
+       el_regex_cache.misses == el_regex_cache.reported_misses)
+      return;
+
+   if (get_verbose() >= VERBOSE_INFO) {
+      for (i = n = 0; i < N_REGEX_CACHE; i++)
+         if (el_regex_cache.entry[i].pattern)
+            n++;
+      eprintf("Regex cache: %d hits, %d misses, %d expressions\n", el_regex_cache.hits,
+              el_regex_cache.misses, n);
+   }
+
+   el_regex_cache.reported_hits = el_regex_cache.hits;
+   el_regex_cache.reported_misses = el_regex_cache.misses;
+}
+
+/*------------------------------------------------------------------*/
+
 void highlight_searchtext(regex_t * re_buf, char *src, char *dst, int hidden)
 {
    char *pt, *pt1;
@@ -19928,7 +23331,7 @@ void highlight_searchtext(regex_t * re_buf, char *src, char *dst, int hidden)
    pt = src;                    /* original text */
    pt1 = dst;                   /* text with inserted coloring */
    do {
-      status = regexec(re_buf, pt, 10, pmatch, 0);
+      status = el_regexec(re_buf, pt, 10, pmatch, 0);
       if (status != REG_NOMATCH) {
          size = pmatch[0].rm_so;
 
@@ -19984,7 +23387,8 @@ time_t search_last_reply(LOGBOOK * lbs, int *message_id)
 
    list = (char *) xmalloc(MAX_REPLY_TO * NAME_LENGTH);
 
-   el_retrieve(lbs, *message_id, date, NULL, NULL, 0, NULL, 0, NULL, reply_to, NULL, NULL, NULL, NULL);
+   if (!el_attr_links(lbs, el_find_index(lbs, *message_id), date, NULL, reply_to, NULL))
+      el_retrieve(lbs, *message_id, date, NULL, NULL, 0, NULL, 0, NULL, reply_to, NULL, NULL, NULL, NULL);
    lt = date_to_ltime(date);
 
    /* if no reply, this is the last message in thread */
@@ -20011,26 +23415,225 @@ time_t search_last_reply(LOGBOOK * lbs, int *message_id)
 
 /*------------------------------------------------------------------*/
 
+/*------------------------------------------------------------------*/
+
+/* Subtext searches over many entries match the entry texts in several
+   threads. Each thread reads the logbook files itself and has its own text
+   buffer, so the file and entry caches of the server thread are not
+   touched. Entries which cannot be read that way, for example because a
+   file has been changed meanwhile, are left to el_retrieve() afterwards. */
+
+#define EL_SEARCH_CHUNK 64
+
+typedef struct {
+   MSG_LIST *msg_list;
+   int *list;                   /* positions in msg_list to search */
+   int n_list;
+   signed char *result;         /* 1 match, 0 no match, -1 not read */
+   regex_t *re;
+   int next;
+#ifdef OS_UNIX
+   pthread_mutex_t mutex;
+#endif
+} EL_SEARCH_QUEUE;
+
+static int el_search_text(LOGBOOK * lbs, int index, regex_t * re, char *data, int data_size, char *buffer)
+/* match the text of an entry in a logbook file read by el_read_file() like the text from
+   el_retrieve(), return -1 if the entry has to be retrieved */
+{
+   char *p, *pt;
+   int size;
+   regmatch_t pmatch[10];
+
+   if (lbs->el_index[index].offset >= data_size)
+      return -1;
+   p = data + lbs->el_index[index].offset;
+   if (strncmp(p, "$@MID@$:", 8) != 0 || atoi(p + 8) != lbs->el_index[index].message_id)
+      return -1;
+
+   pt = el_next_record(p + 8);
+   size = pt ? pt - p : (int) strlen(p);
+   if (size > TEXT_SIZE + 1000 - 1)
+      size = TEXT_SIZE + 1000 - 1;
+   memcpy(buffer, p, size);
+   buffer[size] = 0;
+
+   pt = strstr(buffer, "========================================\n");
+   if (pt == NULL)
+      pt = strstr(buffer, "========================================\r");
+   pt = pt ? pt + 41 : buffer + size;
+
+   /* too long entries give an error in el_retrieve() */
+   size = strlen(pt);
+   if (size >= TEXT_SIZE)
+      return -1;
+
+   if (size > 0 && pt[size - 1] == '\n') {
+      pt[--size] = 0;
+      if (size > 0 && pt[size - 1] == '\r')
+         pt[--size] = 0;
+   }
+
+   return el_regexec(re, pt, 10, pmatch, 0) != REG_NOMATCH;
+}
+
+void *el_search_thread(void *arg)
+{
+   EL_SEARCH_QUEUE *queue;
+   LOGBOOK *lbs;
+   char *buffer, *data, file_name[MAX_PATH_LENGTH], data_name[MAX_PATH_LENGTH];
+   int i, i_start, index, fh, data_size;
+   struct stat st;
+
+   queue = (EL_SEARCH_QUEUE *) arg;
+   buffer = xmalloc(TEXT_SIZE + 1000);
+   data = NULL;
+   data_size = 0;
+   data_name[0] = 0;
+
+   do {
+#ifdef OS_UNIX
+      pthread_mutex_lock(&queue->mutex);
+#endif
+      i_start = queue->next;
+      queue->next += EL_SEARCH_CHUNK;
+#ifdef OS_UNIX
+      pthread_mutex_unlock(&queue->mutex);
+#endif
+
+      if (i_start >= queue->n_list)
+         break;
+
+      for (i = i_start; i < i_start + EL_SEARCH_CHUNK && i < queue->n_list; i++) {
+         lbs = queue->msg_list[queue->list[i]].lbs;
+         index = queue->msg_list[queue->list[i]].index;
+
+         /* entries of a chunk are mostly in the same file, so keep the last one in memory */
+         strlcpy(file_name, lbs->data_dir, sizeof(file_name));
+         strlcat(file_name, el_file(lbs, index)->subdir, sizeof(file_name));
+         strlcat(file_name, el_file(lbs, index)->file_name, sizeof(file_name));
+         if (strcmp(file_name, data_name) != 0) {
+            if (data)
+               xfree(data);
+            data = NULL;
+            strlcpy(data_name, file_name, sizeof(data_name));
+
+            fh = open(file_name, O_RDONLY | O_BINARY);
+            if (fh >= 0) {
+               if (fstat(fh, &st) == 0) {
+                  data_size = (int) st.st_size;
+                  data = el_read_file(fh, data_size);
+               }
+               close(fh);
+            }
+         }
+
+         queue->result[i] = data ? el_search_text(lbs, index, queue->re, data, data_size, buffer) : -1;
+      }
+   } while (1);
+
+   if (data)
+      xfree(data);
+   xfree(buffer);
+
+   return NULL;
+}
+
+void el_search_entries(MSG_LIST * msg_list, int *list, int n_list, regex_t * re)
+/* match the texts of the entries at the given positions of msg_list with re, using several
+   threads if configured, and remove the ones which do not match from msg_list */
+{
+   EL_SEARCH_QUEUE queue;
+   int i, size, n_threads;
+   char *text;
+
+   queue.msg_list = msg_list;
+   queue.list = list;
+   queue.n_list = n_list;
+   queue.result = xmalloc(n_list);
+   queue.re = re;
+   queue.next = 0;
+
+   n_threads = get_threads("Search threads");
+   if (n_threads > (n_list + EL_SEARCH_CHUNK - 1) / EL_SEARCH_CHUNK)
+      n_threads = (n_list + EL_SEARCH_CHUNK - 1) / EL_SEARCH_CHUNK;
+
+#ifdef OS_UNIX
+   pthread_mutex_init(&queue.mutex, NULL);
+
+   if (n_threads > 1) {
+      pthread_t *thread;
+
+      /* current thread takes part in the work, so it does not matter if some threads cannot be created */
+      thread = xmalloc(sizeof(pthread_t) * n_threads);
+      for (i = 0; i < n_threads - 1; i++)
+         if (pthread_create(&thread[i], NULL, el_search_thread, &queue) != 0)
+            break;
+      n_threads = i;
+
+      el_search_thread(&queue);
+
+      for (i = 0; i < n_threads; i++)
+         pthread_join(thread[i], NULL);
+
+      xfree(thread);
+   } else
+#endif
+      el_search_thread(&queue);
+
+#ifdef OS_UNIX
+   pthread_mutex_destroy(&queue.mutex);
+#endif
+
+   text = NULL;
+   for (i = 0; i < n_list; i++) {
+      if (queue.result[i] == -1) {
+         if (text == NULL)
+            text = xmalloc(TEXT_SIZE);
+         size = TEXT_SIZE;
+         if (el_retrieve(msg_list[list[i]].lbs, msg_list[list[i]].lbs->el_index[msg_list[list[i]].index].message_id,
+                         NULL, NULL, NULL, 0, text, &size, NULL, NULL, NULL, NULL, NULL, NULL) == EL_SUCCESS)
+            queue.result[i] = el_regexec(re, text, 0, NULL, 0) != REG_NOMATCH;
+         else
+            queue.result[i] = 0;
+      }
+
+      if (queue.result[i] == 0)
+         msg_list[list[i]].lbs = NULL;
+   }
+
+   xfree(text);
+   xfree(queue.result);
+}
+
+/*------------------------------------------------------------------*/
+
 void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL default_page, char *info)
 {
    int i, j, n, index, size, status, d1, m1, y1, h1, n1, c1, d2, m2, y2, h2, n2, c2, n_line, flags,
-       printable, n_logbook, n_display, reverse, numeric,
+       printable, n_logbook, n_display, reverse, n_sort_key,
        n_attr_disp, n_msg, search_all, message_id, n_page, i_start, i_stop, in_reply_to_id,
-       page_mid, page_mid_head, level, refresh, disp_attr_flags[MAX_N_ATTR + 4];
+       page_mid, page_mid_head, level, refresh, disp_attr_flags[MAX_N_ATTR + 4], attr_column[MAX_N_ATTR + 1],
+       row, j_start, j_stop, n_index, n_text_bucket, n_cand, n_search, *search_list;
    char date[80], attrib[MAX_N_ATTR][NAME_LENGTH], disp_attr[MAX_N_ATTR + 4][NAME_LENGTH], *list, *text,
        *text1, in_reply_to[80], reply_to[MAX_REPLY_TO * 10], attachment[MAX_ATTACHMENTS][MAX_PATH_LENGTH],
        encoding[80], locked_by[256], str[NAME_LENGTH], ref[256], img[80], comment[NAME_LENGTH], mode[80],
        mid[80], menu_str[1000], menu_item[MAX_N_LIST][NAME_LENGTH], param[NAME_LENGTH], format[80],
-       sort_attr[MAX_N_ATTR + 4][NAME_LENGTH], mode_cookie[80], charset[25], sort_item[NAME_LENGTH],
+       mode_cookie[80], charset[25], sort_item[NAME_LENGTH],
        refr[80], str2[80], draft[256];
    char *p, *pt1, *pt2, *slist, *svalue, *gattr, line[1024], iattr[256];
    BOOL show_attachments, threaded, csv, xml, raw, mode_commands, expand, filtering, date_filtering,
        disp_filter, show_text, text_in_attr, searched, found, disp_attr_link[MAX_N_ATTR + 4],
-       sort_attributes, show_att_column = 0;
-   time_t ltime, ltime_start, ltime_end, now, ltime1, ltime2, entry_ltime;
+       text_read, show_att_column = 0;
+   time_t ltime, ltime_start, ltime_end, ltime_cut, now, ltime1, ltime2;
    struct tm tms, *ptms;
    MSG_LIST *msg_list;
+   MSG_KEY *sort_key;
+   int (*compare) (const void *, const void *);
    LOGBOOK *lbs_cur;
+   EL_ATTR_TABLE *attr_table, **cand_table;
+   unsigned short *text_bucket;
+   unsigned char **cand, *text_cand;
    regex_t re_buf[MAX_N_ATTR + 1];
    regmatch_t pmatch[10];
 
@@ -20369,27 +23972,6 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
 
    msg_list = (MSG_LIST *) xmalloc(sizeof(MSG_LIST) * n_msg);
 
-   lbs_cur = lbs;
-   numeric = TRUE;
-   for (i = n = 0; i < n_logbook; i++) {
-      if (search_all)
-         lbs_cur = &lb_list[i];
-
-      if (lbs->top_group[0] && !strieq(lbs->top_group, lbs_cur->top_group))
-         continue;
-
-      if (isparam("unm") && !check_login_user(lbs_cur, getparam("unm")))
-         continue;
-
-      for (j = 0; j < *lbs_cur->n_el_index; j++) {
-         msg_list[n].lbs = lbs_cur;
-         msg_list[n].index = j;
-         msg_list[n].number = (int) lbs_cur->el_index[j].file_time;
-         msg_list[n].in_reply_to = lbs_cur->el_index[j].in_reply_to;
-         n++;
-      }
-   }
-
    /*---- apply start/end date cut ----*/
 
    date_filtering = FALSE;
@@ -20399,37 +23981,55 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
    else if (past_n < 0)
       ltime_start = now + 3600 * past_n;        // past n hours
 
-   if (last_n && last_n < n_msg) {
-      date_filtering = TRUE;
-      for (i = n_msg - last_n - 1; i >= 0; i--)
-         msg_list[i].lbs = NULL;
-   }
+   if (last_n && last_n < n_msg)
+      date_filtering = TRUE;
+
+   if (ltime_start || ltime_end)
+      date_filtering = TRUE;
+
+   ltime_cut = ltime_start;
+   if (isparam("last")) {
+      date_filtering = TRUE;
+      n = atoi(getparam("last"));
+
+      if (n > 0 && ltime_cut < now - 3600 * 24 * n)
+         ltime_cut = now - 3600 * 24 * n;
+   }
+
+   /* the index is sorted by date, so only the range of entries inside the cut is put into
+      the list, the last n entries are counted over all logbooks of the list */
+   lbs_cur = lbs;
+   for (i = n = n_index = 0; i < n_logbook; i++) {
+      if (search_all)
+         lbs_cur = &lb_list[i];
+
+      if (lbs->top_group[0] && !strieq(lbs->top_group, lbs_cur->top_group))
+         continue;
+
+      if (isparam("unm") && !check_login_user(lbs_cur, getparam("unm")))
+         continue;
 
-   if (ltime_start) {
-      date_filtering = TRUE;
-      for (i = 0; i < n_msg; i++)
-         if (msg_list[i].lbs && msg_list[i].lbs->el_index[msg_list[i].index].file_time < ltime_start)
-            msg_list[i].lbs = NULL;
-   }
+      j_start = 0;
+      j_stop = *lbs_cur->n_el_index;
 
-   if (ltime_end) {
-      date_filtering = TRUE;
-      for (i = 0; i < n_msg; i++)
-         if (msg_list[i].lbs && msg_list[i].lbs->el_index[msg_list[i].index].file_time > ltime_end)
-            msg_list[i].lbs = NULL;
-   }
+      if (last_n && last_n < n_msg && j_start < n_msg - last_n - n_index)
+         j_start = n_msg - last_n - n_index;
+      if (ltime_cut && j_start < (j = el_find_time(lbs_cur, ltime_cut - 1)))
+         j_start = j;
+      if (ltime_end)
+         j_stop = el_find_time(lbs_cur, ltime_end);
 
-   if (isparam("last")) {
-      date_filtering = TRUE;
-      n = atoi(getparam("last"));
+      n_index += *lbs_cur->n_el_index;
 
-      if (n > 0) {
-         for (i = 0; i < n_msg; i++)
-            if (msg_list[i].lbs && msg_list[i].lbs->el_index[msg_list[i].index].file_time < now - 3600 * 24
-                * n)
-               msg_list[i].lbs = NULL;
+      for (j = j_start; j < j_stop; j++) {
+         msg_list[n].lbs = lbs_cur;
+         msg_list[n].index = j;
+         msg_list[n].number = (int) lbs_cur->el_index[j].file_time;
+         msg_list[n].in_reply_to = lbs_cur->el_index[j].in_reply_to;
+         n++;
       }
    }
+   n_msg = n;
 
    /*---- filter message list ----*/
 
@@ -20499,7 +24099,7 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
       flags = REG_EXTENDED;
       if (!isparam("casesensitive"))
          flags |= REG_ICASE;
-      status = regcomp(re_buf, str, flags);
+      status = el_regcomp(re_buf, str, flags);
       if (status) {
          sprintf(line, loc("Error in regular expression \"%s\""), str);
          strlcat(line, ": ", sizeof(line));
@@ -20532,7 +24132,7 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
          if (!isparam("casesensitive"))
             flags |= REG_ICASE;
 
-         status = regcomp(re_buf + i + 1, str, flags);
+         status = el_regcomp(re_buf + i + 1, str, flags);
          if (status) {
             sprintf(line, loc("Error in regular expression \"%s\""), str);
             strlcat(line, ": ", sizeof(line));
@@ -20551,9 +24151,63 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
    if (isparam("rsort"))
       strlcpy(sort_item, getparam("rsort"), sizeof(sort_item));
 
-   sort_attributes = getcfg(lbs->name, "Sort Attributes", str, sizeof(str));
+   n_sort_key = msg_sort_init(lbs, sort_item);
+   sort_key = n_sort_key ? (MSG_KEY *) xmalloc(sizeof(MSG_KEY) * n_sort_key * n_msg + 1) : NULL;
+
+   if (sort_item[0]) {
+      if (isparam("rsort"))
+         reverse = 1;
+
+      if (isparam("sort"))
+         reverse = 0;
+   }
+
+   /* get trigrams every entry matching subtext contains */
+   n_text_bucket = 0;
+   text_bucket = NULL;
+   if (isparam("subtext")) {
+      strlcpy(str, getparam("subtext"), sizeof(str));
+      text_bucket = xmalloc(sizeof(unsigned short) * EL_TEXT_BUCKETS);
+      n_text_bucket = el_text_pattern(str, !isparam("casesensitive"), text_bucket);
+
+      /* icon comments searched instead of attribute values are not in the index */
+      if (isparam("sall") && atoi(getparam("sall")))
+         for (i = 0; i < lbs->n_attr; i++)
+            if (attr_flags[i] & AF_ICON)
+               n_text_bucket = 0;
+   }
+
+   /* with several search threads, texts are searched after the other filters */
+   search_list = NULL;
+   n_search = 0;
+   if (isparam("subtext") && get_threads("Search threads") > 1)
+      search_list = xmalloc(sizeof(int) * n_msg + 1);
+
+   /* A text search reads the entries themselves, so it is done in another process as
+      nothing below changes the logbook. The expressions and the slice of the index
+      are taken here, so that their caches stay filled in the server process, while
+      the entries read by the search are only cached in the child process. */
+   if (isparam("subtext") && fork_request()) {
+      xfree(slist);
+      xfree(svalue);
+      xfree(gattr);
+      xfree(list);
+      xfree(msg_list);
+      xfree(sort_key);
+      msg_sort_free();
+      xfree(text);
+      xfree(text1);
+      xfree(text_bucket);
+      xfree(search_list);
+      return;
+   }
 
    /* do filtering */
+   attr_table = NULL;
+   cand_table = NULL;
+   cand = NULL;
+   text_cand = NULL;
+   n_cand = 0;
    for (index = 0; index < n_msg; index++) {
       if (!msg_list[index].lbs)
          continue;
@@ -20563,10 +24217,47 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
       message_id = msg_list[index].lbs->el_index[msg_list[index].index].message_id;
 
       if (filtering) {
-         status = el_retrieve(msg_list[index].lbs, message_id, date, attr_list, attrib, lbs->n_attr, text,
-                              &size, in_reply_to, reply_to, attachment, encoding, locked_by, draft);
-         if (status != EL_SUCCESS)
-            break;
+         /* take attributes from attribute table unless the text has to be searched */
+         if (msg_list[index].lbs->el_attr != attr_table) {
+            attr_table = msg_list[index].lbs->el_attr;
+            el_attr_columns(msg_list[index].lbs, attr_list, lbs->n_attr, attr_column);
+
+            /* candidates for subtext from text index, computed once per table */
+            if (n_text_bucket > 0) {
+               for (i = 0; i < n_cand; i++)
+                  if (cand_table[i] == attr_table)
+                     break;
+               if (i == n_cand) {
+                  cand_table = xrealloc(cand_table, sizeof(EL_ATTR_TABLE *) * (n_cand + 1));
+                  cand = xrealloc(cand, sizeof(unsigned char *) * (n_cand + 1));
+                  cand_table[n_cand] = attr_table;
+                  cand[n_cand++] = el_text_candidates(attr_table, text_bucket, n_text_bucket);
+               }
+               text_cand = cand[i];
+            }
+         }
+
+         /* skip entries which cannot match subtext */
+         row = msg_list[index].lbs->el_index[msg_list[index].index].attr_row;
+         if (text_cand && row >= 0 && row < attr_table->n_rows &&
+             (text_cand[row >> 3] & (1 << (row & 7))) == 0) {
+            msg_list[index].lbs = NULL;
+            continue;
+         }
+
+         text_read = FALSE;
+         if ((isparam("subtext") && !search_list) ||
+             !el_attr_retrieve(msg_list[index].lbs, msg_list[index].index, attr_column, lbs->n_attr, attrib,
+                               date)) {
+            status = el_retrieve(msg_list[index].lbs, message_id, date, attr_list, attrib, lbs->n_attr, text,
+                                 &size, in_reply_to, reply_to, attachment, encoding, locked_by, draft);
+            if (status != EL_SUCCESS) {
+               /* drop only this entry, all others still get their sort keys */
+               msg_list[index].lbs = NULL;
+               continue;
+            }
+            text_read = TRUE;
+         }
 
          /* apply filter for attributes */
          for (i = 0; i < lbs->n_attr; i++) {
@@ -20695,7 +24386,7 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
                }
 
                if (isparam(attr_list[i])) {
-                  status = regexec(re_buf + 1 + i, attrib[i], 10, pmatch, 0);
+                  status = el_regexec(re_buf + 1 + i, attrib[i], 10, pmatch, 0);
                   if (status == REG_NOMATCH)
                      break;
                }
@@ -20709,90 +24400,50 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
 
          if (isparam("subtext")) {
 
-            status = regexec(re_buf, text, 10, pmatch, 0);
+            /* texts which were not read are searched after this loop */
+            status = text_read ? el_regexec(re_buf, text, 10, pmatch, 0) : REG_NOMATCH;
             if (isparam("sall") && atoi(getparam("sall")) && status == REG_NOMATCH) {
 
                // search text in attributes
                for (i = 0; i < lbs->n_attr; i++) {
-                  status = regexec(re_buf, attrib[i], 10, pmatch, 0);
+                  status = el_regexec(re_buf, attrib[i], 10, pmatch, 0);
                   if (status != REG_NOMATCH)
                      break;
                }
 
                if (i == lbs->n_attr) {
+                  if (!text_read)
+                     search_list[n_search++] = index;
+                  else {
+                     msg_list[index].lbs = NULL;
+                     continue;
+                  }
+               }
+            } else if (status == REG_NOMATCH) {
+               if (!text_read)
+                  search_list[n_search++] = index;
+               else {
                   msg_list[index].lbs = NULL;
                   continue;
                }
-            } else if (status == REG_NOMATCH) {
-               msg_list[index].lbs = NULL;
-               continue;
             }
          }
       }                         // if (filtering)
 
-      /* evaluate "sort attributes" */
-      if (sort_attributes) {
-         getcfg(lbs->name, "Sort Attributes", list, 10000);
-         msg_list[index].string[0] = 0;
-         n = strbreak(list, sort_attr, MAX_N_ATTR, ",", FALSE);
-         for (i = 0; i < n; i++) {
-            for (j = 0; j < lbs->n_attr; j++) {
-               if (strieq(sort_attr[i], attr_list[j])) {
-                  strlcat(msg_list[index].string, " ", sizeof(msg_list[index].string));
-                  strlcat(msg_list[index].string, attrib[j], sizeof(msg_list[index].string));
-                  if (attr_flags[i] & (AF_NUMERIC | AF_DATETIME | AF_DATE)) {
-                     msg_list[index].number = atoi(attrib[j]);
-                     numeric = TRUE;
-                  } else
-                     numeric = FALSE;
-                  break;
-               }
-            }
-            if (strieq(sort_attr[i], loc("ID"))) {
-               strlcat(msg_list[index].string, " ", sizeof(msg_list[index].string));
-               sprintf(str, "%08d", message_id);
-               strlcat(msg_list[index].string, str, sizeof(msg_list[index].string));
-            } else if (strieq(sort_attr[i], loc("Logbook"))) {
-               strlcat(msg_list[index].string, " ", sizeof(msg_list[index].string));
-               strlcat(msg_list[index].string, msg_list[index].lbs->name, sizeof(msg_list[index].string));
-            } else if (strieq(sort_attr[i], loc("Date"))) {
-               strlcat(msg_list[index].string, " ", sizeof(msg_list[index].string));
-               entry_ltime = date_to_ltime(date);
-               sprintf(str, "%08d", (int) entry_ltime);
-               strlcat(msg_list[index].string, str, sizeof(msg_list[index].string));
-            }
-         }
-      }
-
-      /* add attribute for sorting */
-      if (sort_item[0]) {
-         for (i = 0; i < lbs->n_attr; i++) {
-            if (strieq(sort_item, attr_list[i])) {
-               if (attr_flags[i] & (AF_NUMERIC | AF_DATETIME | AF_DATE)) {
-                  numeric = TRUE;
-                  msg_list[index].number = atoi(attrib[i]);
-               } else {
-                  numeric = FALSE;
-                  strlcpy(msg_list[index].string, attrib[i], 256);
-               }
-            }
-
-            if (strieq(sort_item, loc("ID"))) {
-               numeric = TRUE;
-               msg_list[index].number = message_id;
-            }
-
-            if (strieq(sort_item, loc("Logbook")))
-               strlcpy(msg_list[index].string, msg_list[index].lbs->name, 256);
-         }
+      /* evaluate sort keys */
+      if (n_sort_key)
+         msg_sort_set(&msg_list[index], sort_key + index * n_sort_key, message_id, date, attrib);
+   }
 
-         if (isparam("rsort"))
-            reverse = 1;
+   for (i = 0; i < n_cand; i++)
+      xfree(cand[i]);
+   xfree(cand);
+   xfree(cand_table);
+   xfree(text_bucket);
 
-         if (isparam("sort"))
-            reverse = 0;
-      }
-   }
+   if (n_search > 0)
+      el_search_entries(msg_list, search_list, n_search, re_buf);
+   xfree(search_list);
 
    /*---- in threaded mode, set date of latest entry of thread ----*/
 
@@ -20801,29 +24452,16 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
          if (!msg_list[index].lbs)
             continue;
 
-         message_id = msg_list[index].lbs->el_index[msg_list[index].index].message_id;
          in_reply_to_id = msg_list[index].lbs->el_index[msg_list[index].index].in_reply_to;
          if (!in_reply_to_id)
             continue;
 
-         do {
-            message_id = in_reply_to_id;
-
-            /* search index of message */
-            for (i = 0; i < *msg_list[index].lbs->n_el_index; i++)
-               if (msg_list[index].lbs->el_index[i].message_id == message_id)
-                  break;
-
-            /* stop if not found */
-            if (i == *msg_list[index].lbs->n_el_index)
-               break;
-
-            in_reply_to_id = msg_list[index].lbs->el_index[i].in_reply_to;
-
-         } while (in_reply_to_id);
+         /* search index of thread head */
+         message_id = msg_list[index].lbs->el_index[msg_list[index].index].thread_head;
+         i = el_find_index(msg_list[index].lbs, message_id);
 
          /* if head not found, skip message */
-         if (i == *msg_list[index].lbs->n_el_index) {
+         if (i < 0) {
             msg_list[index].lbs = NULL;
             continue;
          }
@@ -20832,10 +24470,11 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
          if (page_mid && msg_list[index].lbs->el_index[msg_list[index].index].message_id == page_mid)
             page_mid_head = message_id;
 
-         /* search message head in list */
-         for (j = 0; j < n_msg; j++)
-            if (msg_list[j].lbs == msg_list[index].lbs && msg_list[j].index == i)
-               break;
+         /* the entries of a logbook are in index order in the list, so the head
+            is found relative to the current message */
+         j = index - msg_list[index].index + i;
+         if (j < 0 || j >= n_msg || msg_list[j].lbs != msg_list[index].lbs || msg_list[j].index != i)
+            j = n_msg;
 
          if (j < index) {
             /* set date from current message, if later */
@@ -20855,12 +24494,10 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
          memcpy(&msg_list[j++], &msg_list[i], sizeof(MSG_LIST));
    n_msg = j;
 
-   /*---- sort messasges ----*/
-
-   if (numeric)
-      qsort(msg_list, n_msg, sizeof(MSG_LIST), reverse ? msg_compare_reverse_numeric : msg_compare_numeric);
+   if (n_sort_key == 0)
+      compare = reverse ? msg_compare_reverse_numeric : msg_compare_numeric;
    else
-      qsort(msg_list, n_msg, sizeof(MSG_LIST), reverse ? msg_compare_reverse : msg_compare);
+      compare = reverse ? msg_compare_reverse : msg_compare;
 
    /*---- search page for specific message ----*/
 
@@ -20874,13 +24511,19 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
    if (page_mid) {
       default_page = 0;
 
-      for (i = 0; i < n_msg; i++)
+      /* first of message and thread head in sorted order, its position is found by counting */
+      for (i = 0, j = -1; i < n_msg; i++)
          if (msg_list[i].lbs->el_index[msg_list[i].index].message_id == page_mid
              || msg_list[i].lbs->el_index[msg_list[i].index].message_id == page_mid_head)
-            break;
+            if (j == -1 || msg_order(msg_list, i, j, compare) < 0)
+               j = i;
 
-      if (i < n_msg)
-         page_n = i / n_page + 1;
+      if (j >= 0) {
+         for (i = n = 0; i < n_msg; i++)
+            if (msg_order(msg_list, i, j, compare) < 0)
+               n++;
+         page_n = n / n_page + 1;
+      }
    }
 
    /*---- number of messages per page ----*/
@@ -20908,6 +24551,14 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
       }
    }
 
+   /*---- sort messasges ----*/
+
+   /* for a single page only its entries are brought into place */
+   if (n_msg > 0 && i_start <= i_stop && (i_start > 0 || i_stop < n_msg - 1))
+      msg_select(msg_list, n_msg, i_start, i_stop, compare);
+   else
+      qsort(msg_list, n_msg, sizeof(MSG_LIST), compare);
+
    /*---- header ----*/
 
    if (getcfg(lbs->name, "List Page Title", str, sizeof(str))) {
@@ -21591,7 +25242,14 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
 
    /*---- display message list ----*/
 
+   /* exports can get large, so send them in chunks while they are produced */
+   if (csv || xml || raw)
+      start_chunked_output();
+
    for (index = i_start; index <= i_stop; index++) {
+      if (chunked_output && strlen_retbuf > 65536)
+         flush_return_buffer();
+
       size = TEXT_SIZE;
       message_id = msg_list[index].lbs->el_index[msg_list[index].index].message_id;
 
@@ -21880,15 +25538,15 @@ void show_elog_list(LOGBOOK * lbs, int past_n, int last_n, int page_n, BOOL defa
       rsputs("</ELOG_LIST>\n");
    }
 
-   regfree(re_buf);
-   for (i = 0; i < lbs->n_attr; i++)
-      regfree(re_buf + 1 + i);
+   end_chunked_output();
 
    xfree(slist);
    xfree(svalue);
    xfree(gattr);
    xfree(list);
    xfree(msg_list);
+   xfree(sort_key);
+   msg_sort_free();
    xfree(text);
    xfree(text1);
 }
@@ -21900,14 +25558,11 @@ int find_thread_head(LOGBOOK * lbs, int message_id)
    int i;
 
    /* search index of message */
-   for (i = 0; i < *lbs->n_el_index; i++)
-      if (lbs->el_index[i].message_id == message_id)
-         break;
-
-   if (lbs->el_index[i].in_reply_to)
-      return find_thread_head(lbs, lbs->el_index[i].in_reply_to);
+   i = el_find_index(lbs, message_id);
+   if (i < 0)
+      return message_id;
 
-   return message_id;
+   return lbs->el_index[i].thread_head;
 }
 
 /*------------------------------------------------------------------*/
@@ -21922,16 +25577,8 @@ void show_elog_thread(LOGBOOK * lbs, int message_id, int absolute_links, int hig
 
    text = (char *) xmalloc(TEXT_SIZE);
 
-   /* retrieve message */
-   size = TEXT_SIZE;
-   el_retrieve(lbs, message_id, date, attr_list, attrib, lbs->n_attr, text, &size, in_reply_to,
-                        reply_to, attachment, encoding, locked_by, draft);
-
    /* find message head */
-   if (atoi(in_reply_to))
-      head_id = find_thread_head(lbs, atoi(in_reply_to));
-   else
-      head_id = message_id;
+   head_id = find_thread_head(lbs, message_id);
 
    n_attr_disp = lbs->n_attr + 2;
    strcpy(disp_attr[0], loc("ID"));
@@ -23806,11 +27453,8 @@ void submit_elog_mirror(LOGBOOK * lbs)
    }
 
    /* check if message already exists */
-   for (i = 0; i < *lbs->n_el_index; i++)
-      if (lbs->el_index[i].message_id == message_id) {
-         bedit = TRUE;
-         break;
-      }
+   if (el_find_index(lbs, message_id) >= 0)
+      bedit = TRUE;
 
    message_id = el_submit(lbs, message_id, bedit, date, attrib_name, attrib_value, n_attr, getparam("text"),
                           in_reply_to, reply_to, encoding, att_file, FALSE, NULL, NULL);
@@ -27114,7 +30758,7 @@ void show_uploader_json(LOGBOOK *lbs)
 
    rsprintf("HTTP/1.1 200 Document follows\r\n");
    rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
-   rsprintf("Accept-Ranges: bytes\r\n");
+   rsprintf("Accept-Ranges: none\r\n");
    rsprintf("Pragma: no-cache\r\n");
    rsprintf("Cache-control: private, max-age=0, no-cache, no-store\r\n");
    if (keep_alive) {
@@ -28606,80 +32250,453 @@ void decode_post(char *logbook, LOGBOOK * lbs, const char *string, const char *b
                   setparam(str, full_name);
                }
 
-               string = strstr(p, boundary) + strlen(boundary);
-            } else
-               string = strstr(string, boundary) + strlen(boundary);
-         } else {
-            p = string;
-            if (strstr(p, "\r\n\r\n"))
-               p = strstr(p, "\r\n\r\n") + 4;
-            else if (strstr(p, "\r\r\n\r\r\n"))
-               p = strstr(p, "\r\r\n\r\r\n") + 6;
-            if (strstr(p, boundary)) {
+               string = strstr(p, boundary) + strlen(boundary);
+            } else
+               string = strstr(string, boundary) + strlen(boundary);
+         } else {
+            p = string;
+            if (strstr(p, "\r\n\r\n"))
+               p = strstr(p, "\r\n\r\n") + 4;
+            else if (strstr(p, "\r\r\n\r\r\n"))
+               p = strstr(p, "\r\r\n\r\r\n") + 6;
+            if (strstr(p, boundary)) {
+
+               string = strstr(p, boundary) + strlen(boundary);
+
+               if (stricmp(item, "text") == 0) {
+                  if (string - p > TEXT_SIZE) {
+                     sprintf(str,
+                             "Error: Entry text too big. Please increase TEXT_SIZE and recompile elogd\n");
+                     show_error(str);
+                     return;
+                  }
+                  strlcpy(_mtext, p, sizeof(_mtext));
+                  if (strstr(_mtext, boundary))
+                     *strstr(_mtext, boundary) = 0;
+                  ptmp = _mtext + (strlen(_mtext) - 1);
+                  while (*ptmp == '-')
+                     *ptmp-- = 0;
+                  while (*ptmp == '\n' || *ptmp == '\r')
+                     *ptmp-- = 0;
+               } else {
+                  strlcpy(str, p, sizeof(str));
+                  if (strstr(str, boundary))
+                     *strstr(str, boundary) = 0;
+                  ptmp = str + (strlen(str) - 1);
+                  while (*ptmp == '-')
+                     *ptmp-- = 0;
+                  while (*ptmp == '\n' || *ptmp == '\r')
+                     *ptmp-- = 0;
+
+                  if (setparam(item, str) == 0)
+                     return;
+               }
+            } else {
+               strlcpy(str, p, sizeof(str));
+               if (setparam(item, str) == 0)
+                  return;
+               string = p + strlen(p);
+            }
+         }
+
+         while (*string == '-' || *string == '\n' || *string == '\r')
+            string++;
+      } else
+         return;                /* invalid request */
+
+   } while ((int) (string - pinit) < length);
+
+   if (lbs)
+      interprete(lbs->name, "");
+   else
+      interprete(logbook, "");
+}
+
+/*------------------------------------------------------------------*/
+
+/* Open connections are kept in a table which grows as needed. With epoll, the number
+   of connections is not limited, while select() can only watch N_MAX_CONNECTION of them
+   and the oldest one is recycled if the table is full. Connections idle for more than
+   KEEP_ALIVE_TIME seconds are found through a timer wheel with one slot per second,
+   each slot holding a list of the connections expiring in that second. */
+
+#define N_MAX_CONNECTION 100
+#define KEEP_ALIVE_TIME   60
+#define KA_WHEEL_SIZE     64    /* power of two above KEEP_ALIVE_TIME */
+
+int *ka_sock;
+int *ka_time;
+#ifdef HAVE_SSL
+SSL **ka_ssl_con;
+#endif
+struct in_addr *remote_addr;
+char (*remote_host)[256];
+int *ka_next, *ka_prev;         /* list of wheel slot, or list of free entries */
+int n_ka_alloc;
+int ka_free = -1;
+int ka_wheel[KA_WHEEL_SIZE];
+int ka_wheel_time;
+int ka_epoll_fd = -1;
+
+#define KA_SLOT(t) (((t) + KEEP_ALIVE_TIME + 1) & (KA_WHEEL_SIZE - 1))
+
+/* Requests are assembled in a buffer of their connection from whatever data arrived,
+   so a slow client does not hold up the others. The end of the header is searched
+   only in newly received data, and a request is handled once it is complete. */
+
+typedef struct {
+   char *buffer;                /* received data, zero terminated */
+   int size;                    /* allocated size of buffer */
+   int len;                     /* number of bytes received */
+   int scan;                    /* bytes searched for the end of the header */
+   int header_length;           /* length of header with empty line, 0 if incomplete */
+   int content_length;          /* length of POST body */
+   int discard;                 /* bytes of a too large body still to be skipped */
+   BOOL eof;                    /* connection closed by client */
+} KA_REQUEST;
+
+KA_REQUEST *ka_request;
+
+#define KA_BUFFER_SIZE  8192    /* initial buffer size, larger buffers are not kept */
+
+#define KA_INCOMPLETE      0
+#define KA_COMPLETE        1
+#define KA_TOO_LARGE       2
+#define KA_BROKEN         -1
+
+/* events taken from epoll at once, and markers of the non-connection descriptors */
+#define N_KA_EVENTS      256
+#define KA_LISTEN         -1
+#define KA_WATCH          -2
+
+static void ka_wheel_link(int i)
+{
+   int slot;
+
+   slot = KA_SLOT(ka_time[i]);
+   ka_prev[i] = -1;
+   ka_next[i] = ka_wheel[slot];
+   if (ka_wheel[slot] >= 0)
+      ka_prev[ka_wheel[slot]] = i;
+   ka_wheel[slot] = i;
+}
+
+static void ka_wheel_unlink(int i)
+{
+   if (ka_prev[i] >= 0)
+      ka_next[ka_prev[i]] = ka_next[i];
+   else
+      ka_wheel[KA_SLOT(ka_time[i])] = ka_next[i];
+   if (ka_next[i] >= 0)
+      ka_prev[ka_next[i]] = ka_prev[i];
+}
+
+static void ka_reset(int i)
+/* empty request buffer of connection, giving back memory of large requests */
+{
+   KA_REQUEST *r;
+
+   r = &ka_request[i];
+   if (r->size > KA_BUFFER_SIZE) {
+      xfree(r->buffer);
+      r->buffer = NULL;
+      r->size = 0;
+   }
+   if (r->buffer)
+      r->buffer[0] = 0;
+   r->len = r->scan = r->header_length = r->content_length = r->discard = 0;
+   r->eof = FALSE;
+}
+
+void ka_init()
+{
+   int i;
+
+   for (i = 0; i < KA_WHEEL_SIZE; i++)
+      ka_wheel[i] = -1;
+   ka_wheel_time = (int) time(NULL);
+}
+
+void ka_touch(int i)
+/* mark connection as used now */
+{
+   ka_wheel_unlink(i);
+   ka_time[i] = (int) time(NULL);
+   ka_wheel_link(i);
+}
+
+int ka_open(int sock)
+/* enter new connection in table, return its position or -1 if the table is full */
+{
+   int i, n;
+#ifdef HAVE_EPOLL
+   struct epoll_event ev;
+#endif
+
+   if (ka_free < 0 && (ka_epoll_fd >= 0 || n_ka_alloc < N_MAX_CONNECTION)) {
+      n = n_ka_alloc ? 2 * n_ka_alloc : 16;
+      if (ka_epoll_fd < 0 && n > N_MAX_CONNECTION)
+         n = N_MAX_CONNECTION;
+
+      ka_sock = xrealloc(ka_sock, sizeof(int) * n);
+      ka_time = xrealloc(ka_time, sizeof(int) * n);
+#ifdef HAVE_SSL
+      ka_ssl_con = xrealloc(ka_ssl_con, sizeof(SSL *) * n);
+#endif
+      remote_addr = xrealloc(remote_addr, sizeof(struct in_addr) * n);
+      remote_host = xrealloc(remote_host, 256 * n);
+      ka_next = xrealloc(ka_next, sizeof(int) * n);
+      ka_prev = xrealloc(ka_prev, sizeof(int) * n);
+      ka_request = xrealloc(ka_request, sizeof(KA_REQUEST) * n);
+
+      for (i = n_ka_alloc; i < n; i++) {
+         ka_sock[i] = ka_time[i] = 0;
+         memset(&ka_request[i], 0, sizeof(KA_REQUEST));
+#ifdef HAVE_SSL
+         ka_ssl_con[i] = NULL;
+#endif
+         ka_next[i] = i + 1 < n ? i + 1 : -1;
+      }
+      ka_free = n_ka_alloc;
+      n_ka_alloc = n;
+   }
+
+   if (ka_free < 0)
+      return -1;
+
+   i = ka_free;
+   ka_free = ka_next[i];
+
+   ka_sock[i] = sock;
+   ka_time[i] = (int) time(NULL);
+   ka_wheel_link(i);
+   ka_reset(i);
+
+#ifdef HAVE_EPOLL
+   if (ka_epoll_fd >= 0) {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.fd = i;
+      epoll_ctl(ka_epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+   }
+#endif
+
+   return i;
+}
+
+void ka_close(int i, BOOL shutdown)
+/* close connection and remove it from table, an SSL session is only ended with shutdown */
+{
+#ifdef HAVE_SSL
+   if (ka_ssl_con[i]) {
+      if (shutdown) {
+         SSL_set_fd(ka_ssl_con[i], ka_sock[i]);
+         SSL_shutdown(ka_ssl_con[i]);
+      }
+      SSL_free(ka_ssl_con[i]);
+      ka_ssl_con[i] = NULL;
+   }
+#else
+   (void) shutdown;
+#endif
+#ifdef HAVE_EPOLL
+   /* a child process might still hold the socket, so remove it explicitly */
+   if (ka_epoll_fd >= 0)
+      epoll_ctl(ka_epoll_fd, EPOLL_CTL_DEL, ka_sock[i], NULL);
+#endif
+   closesocket(ka_sock[i]);
+   ka_wheel_unlink(i);
+   ka_reset(i);
+
+   ka_sock[i] = ka_time[i] = 0;
+   ka_next[i] = ka_free;
+   ka_free = i;
+}
+
+void ka_expire()
+/* close connections which have not been used for KEEP_ALIVE_TIME seconds */
+{
+   int i, next, n, now;
+
+   now = (int) time(NULL);
+   for (n = 0; ka_wheel_time < now && n < KA_WHEEL_SIZE; n++) {
+      ka_wheel_time++;
+      for (i = ka_wheel[ka_wheel_time & (KA_WHEEL_SIZE - 1)]; i >= 0; i = next) {
+         next = ka_next[i];
+         if (now - ka_time[i] > KEEP_ALIVE_TIME)
+            ka_close(i, TRUE);
+      }
+   }
+   ka_wheel_time = now;
+}
+
+int ka_oldest()
+/* return oldest connection in table */
+{
+   int i, i_min;
+
+   for (i = i_min = 0; i < n_ka_alloc; i++)
+      if (ka_time[i] < ka_time[i_min])
+         i_min = i;
+
+   return i_min;
+}
 
-               string = strstr(p, boundary) + strlen(boundary);
+int ka_parse(int i)
+/* check if buffer of connection holds a complete request */
+{
+   KA_REQUEST *r;
+   char *p, *p1, *p2, c;
+   int n;
 
-               if (stricmp(item, "text") == 0) {
-                  if (string - p > TEXT_SIZE) {
-                     sprintf(str,
-                             "Error: Entry text too big. Please increase TEXT_SIZE and recompile elogd\n");
-                     show_error(str);
-                     return;
-                  }
-                  strlcpy(_mtext, p, sizeof(_mtext));
-                  if (strstr(_mtext, boundary))
-                     *strstr(_mtext, boundary) = 0;
-                  ptmp = _mtext + (strlen(_mtext) - 1);
-                  while (*ptmp == '-')
-                     *ptmp-- = 0;
-                  while (*ptmp == '\n' || *ptmp == '\r')
-                     *ptmp-- = 0;
-               } else {
-                  strlcpy(str, p, sizeof(str));
-                  if (strstr(str, boundary))
-                     *strstr(str, boundary) = 0;
-                  ptmp = str + (strlen(str) - 1);
-                  while (*ptmp == '-')
-                     *ptmp-- = 0;
-                  while (*ptmp == '\n' || *ptmp == '\r')
-                     *ptmp-- = 0;
+   r = &ka_request[i];
+   if (r->len == 0)
+      return KA_INCOMPLETE;
+
+   if (r->header_length == 0) {
+      /* the empty line might have started in data searched before */
+      p = r->buffer + (r->scan > 5 ? r->scan - 5 : 0);
+      p1 = strstr(p, "\r\n\r\n");
+      p2 = strstr(p, "\r\r\n\r\r\n");
+      if (p1 == NULL && p2 == NULL) {
+         r->scan = r->len;
+         return KA_INCOMPLETE;
+      }
+      if (p1 && (p2 == NULL || p1 < p2))
+         r->header_length = p1 - r->buffer + 4;
+      else
+         r->header_length = p2 - r->buffer + 6;
 
-                  if (setparam(item, str) == 0)
-                     return;
-               }
-            } else {
-               strlcpy(str, p, sizeof(str));
-               if (setparam(item, str) == 0)
-                  return;
-               string = p + strlen(p);
-            }
-         }
+      if (strncmp(r->buffer, "POST", 4) == 0) {
+         /* look for content length only in the header */
+         c = r->buffer[r->header_length];
+         r->buffer[r->header_length] = 0;
+         if (strstr(r->buffer, "Content-Length:"))
+            r->content_length = atoi(strstr(r->buffer, "Content-Length:") + 15);
+         else if (strstr(r->buffer, "Content-length:"))
+            r->content_length = atoi(strstr(r->buffer, "Content-length:") + 15);
+         r->buffer[r->header_length] = c;
 
-         while (*string == '-' || *string == '\n' || *string == '\r')
-            string++;
-      } else
-         return;                /* invalid request */
+         if (r->content_length < 0)
+            return KA_BROKEN;
+         if (r->content_length > _max_content_length)
+            r->discard = r->content_length;
+      }
+   }
 
-   } while ((int) (string - pinit) < length);
+   if (strncmp(r->buffer, "POST", 4) != 0)
+      return KA_COMPLETE;
 
-   if (lbs)
-      interprete(lbs->name, "");
-   else
-      interprete(logbook, "");
+   /* skip body which is not going to be accepted */
+   if (r->content_length > _max_content_length) {
+      n = r->len - r->header_length;
+      if (n > r->discard)
+         n = r->discard;
+      r->discard -= n;
+      r->len = r->header_length;
+      r->buffer[r->len] = 0;
+      return r->discard > 0 ? KA_INCOMPLETE : KA_TOO_LARGE;
+   }
+
+   return r->len >= r->header_length + r->content_length ? KA_COMPLETE : KA_INCOMPLETE;
 }
 
-/*------------------------------------------------------------------*/
+int ka_read(int i)
+/* receive all data available on connection without blocking, return state of request */
+{
+   KA_REQUEST *r;
+   int n, status;
+#ifdef OS_UNIX
+   int flags;
+#else
+   u_long mode;
+#endif
 
-#define N_MAX_CONNECTION 100
-#define KEEP_ALIVE_TIME   60
+   r = &ka_request[i];
+   status = KA_INCOMPLETE;
+
+#ifdef OS_UNIX
+   flags = fcntl(ka_sock[i], F_GETFL);
+   fcntl(ka_sock[i], F_SETFL, flags | O_NONBLOCK);
+#else
+   mode = 1;
+   ioctlsocket(ka_sock[i], FIONBIO, &mode);
+#endif
 
-int ka_sock[N_MAX_CONNECTION];
-int ka_time[N_MAX_CONNECTION];
+   do {
+      if (r->size - r->len < KA_BUFFER_SIZE / 2) {
+         r->size = r->size ? 2 * r->size : KA_BUFFER_SIZE;
+         r->buffer = xrealloc(r->buffer, r->size);
+      }
 #ifdef HAVE_SSL
-SSL *ka_ssl_con[N_MAX_CONNECTION];
+      if (ka_ssl_con[i]) {
+         n = SSL_read(ka_ssl_con[i], r->buffer + r->len, r->size - r->len - 1);
+         if (n < 0 && (SSL_get_error(ka_ssl_con[i], n) == SSL_ERROR_WANT_READ ||
+                       SSL_get_error(ka_ssl_con[i], n) == SSL_ERROR_WANT_WRITE))
+            break;
+      } else
+#endif
+      {
+         n = recv(ka_sock[i], r->buffer + r->len, r->size - r->len - 1, 0);
+#ifdef OS_UNIX
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+#else
+         if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+            break;
+#endif
+      }
+
+      if (get_verbose() == VERBOSE_URL)
+         eprintf("Connection #%d received %d bytes on socket %d\n", i, n, ka_sock[i]);
+
+      /* connection closed or broken, requests received before are still handled */
+      if (n <= 0) {
+         r->eof = TRUE;
+         if (status == KA_INCOMPLETE)
+            status = KA_BROKEN;
+         break;
+      }
+
+      r->len += n;
+      r->buffer[r->len] = 0;
+      status = ka_parse(i);
+
+   } while (status != KA_BROKEN);
+
+#ifdef OS_UNIX
+   fcntl(ka_sock[i], F_SETFL, flags);
+#else
+   mode = 0;
+   ioctlsocket(ka_sock[i], FIONBIO, &mode);
 #endif
-struct in_addr remote_addr[N_MAX_CONNECTION];
-char remote_host[N_MAX_CONNECTION][256];
+
+   return status;
+}
+
+int ka_next_request(int i)
+/* remove handled request from buffer of connection and check for a pipelined one */
+{
+   KA_REQUEST *r;
+   int n;
+
+   r = &ka_request[i];
+   n = r->header_length;
+   if (strncmp(r->buffer, "POST", 4) == 0)
+      n += r->content_length;
+   if (n >= r->len) {
+      ka_reset(i);
+      return KA_INCOMPLETE;
+   }
+
+   r->len -= n;
+   memmove(r->buffer, r->buffer + n, r->len + 1);
+   r->scan = r->header_length = r->content_length = r->discard = 0;
+
+   return ka_parse(i);
+}
 
 int process_http_request(const char *request, int i_conn)
 {
@@ -28687,7 +32704,7 @@ int process_http_request(const char *request, int i_conn)
    char str2[1000], url[2000], format[256], cookie[256], boundary[256],
        list[1000], theme[256], host_list[MAX_N_LIST][NAME_LENGTH], logbook[256], logbook_enc[256],
        global_cmd[256];
-   char *p, *str;
+   char *p, *pend, *str;
    struct hostent *phe;
    time_t now;
    struct tm *ts;
@@ -28791,6 +32808,26 @@ int process_http_request(const char *request, int i_conn)
          *strchr(browser, '\r') = 0;
    }
 
+   /* extract byte ranges, only from the header of this request */
+   http_range[0] = http_if_range[0] = 0;
+   pend = strstr(request, "\r\n\r\n");
+   if ((p = stristr(request, "\nRange:")) != NULL && (pend == NULL || p < pend)) {
+      p += 7;
+      while (*p && *p == ' ')
+         p++;
+      strlcpy(http_range, p, sizeof(http_range));
+      if (strchr(http_range, '\r'))
+         *strchr(http_range, '\r') = 0;
+   }
+   if ((p = stristr(request, "\nIf-Range:")) != NULL && (pend == NULL || p < pend)) {
+      p += 10;
+      while (*p && *p == ' ')
+         p++;
+      strlcpy(http_if_range, p, sizeof(http_if_range));
+      if (strchr(http_if_range, '\r'))
+         *strchr(http_if_range, '\r') = 0;
+   }
+
    /* extract host */
    http_host[0] = 0;
    if ((p = strstr(request, "Host:")) != NULL) {
@@ -28865,12 +32902,23 @@ int process_http_request(const char *request, int i_conn)
 
    return_length = 0;
 
+   /* close file of a response which has not been sent */
+   if (return_file >= 0) {
+      close(return_file);
+      return_file = -1;
+   }
+
    /* check for Keep-alive */
    if (strstr(request, "Keep-Alive") != NULL && use_keepalive)
       keep_alive = TRUE;
    if (strstr(request, "keep-alive") != NULL && use_keepalive)
       keep_alive = TRUE;
 
+   /* chunked responses need an HTTP/1.1 client */
+   p = strstr(request, "HTTP/1.1");
+   http_1_1 = p != NULL && (strchr(request, '\r') == NULL || p < strchr(request, '\r'));
+   chunked_output = FALSE;
+
    /* extract logbook */
    if (strchr(request, '/') == NULL || strchr(request, '\r') == NULL || strstr(request, "HTTP") == NULL) {
       /* invalid request, make valid */
@@ -29239,9 +33287,10 @@ void send_return(int _sock, SSL * ssl_con, const char *net_buffer)
 void send_return(int _sock, const char *net_buffer)
 #endif
 {
-   int length, header_length;
+   int i, length, header_length;
    char str[NAME_LENGTH];
    char *p;
+   BOOL complete;
 #ifndef HAVE_SSL
    void *ssl_con = NULL;
 #endif
@@ -29345,6 +33394,30 @@ void send_return(int _sock, const char *net_buffer)
             eprintf("\n\n");
          }
       }
+
+      /* body of a file-backed response follows the header; if the file got shorter or
+         could not be sent completely, the client cannot find the end of the response,
+         so the connection has to be closed */
+      if (return_file >= 0) {
+         complete = TRUE;
+         for (i = 0; i < n_return_range && complete; i++) {
+            if (n_return_range > 1) {
+               range_part_header(str, i);
+               complete = send_with_timeout(ssl_con, _sock, str, strlen(str)) == (int) strlen(str);
+            }
+            if (complete)
+               complete = send_file_body(ssl_con, _sock, return_file, return_range[i][0],
+                                         return_range[i][1]) == return_range[i][1];
+         }
+         if (n_return_range > 1 && complete) {
+            sprintf(str, "\r\n--%s--\r\n", return_boundary);
+            send_with_timeout(ssl_con, _sock, str, strlen(str));
+         }
+         if (!complete)
+            keep_alive = FALSE;
+         close(return_file);
+         return_file = -1;
+      }
    }
 }
 
@@ -29536,16 +33609,23 @@ SSL_CTX *init_ssl(void)
 
 void server_loop(void)
 {
-   int status, i, broken, min, i_min, i_conn, more_requests;
-   char str[1000], logbook[256], logbook_enc[256];
-   char *pend;
-   int lsock, len, flag, content_length, header_length;
+   int status, state, i, j, i_conn, n_ready, i_ready;
+   char str[1000];
+   int lsock, len, flag;
+   double start_time;
    struct sockaddr_in serv_addr, acc_addr;
    struct hostent *phe;
    fd_set readfds;
    struct timeval timeout;
-   char *net_buffer = NULL;
-   int net_buffer_size;
+   BOOL accept_pending, watch_ready;
+   struct {
+      int index, sock;
+   } ready[N_KA_EVENTS];
+#ifdef HAVE_EPOLL
+   struct epoll_event ev, events[N_KA_EVENTS];
+   int watch_generation;
+#endif
+   char *net_buffer;
 #ifdef HAVE_SSL
    SSL_CTX *ssl_ctx = NULL;
 #endif
@@ -29558,12 +33638,9 @@ void server_loop(void)
    struct sigaction alarm_handle;
 #endif
 
-   i_conn = content_length = 0;
-   net_buffer_size = 100000;
-   net_buffer = xmalloc(net_buffer_size);
+   i_conn = 0;
    return_buffer_size = 100000;
    return_buffer = xmalloc(return_buffer_size);
-   pend = NULL;
 
    /* determine logging level */
    if (getcfg(NULL, "Logging Level", str, sizeof(str)))
@@ -29823,10 +33900,16 @@ void server_loop(void)
    /* build logbook indices */
    if (get_verbose() == 0 && !running_as_daemon)
       eprintf("Indexing logbooks ... ");
+   start_time = get_wall_time();
    if (el_index_logbooks() != EL_SUCCESS)
       exit(EXIT_FAILURE);
+
+   /* tombstones are not known to older versions of elogd, so remove them all
+      once "Append only" has been switched off */
+   if (!el_append_only())
+      el_compact_logbooks(TRUE);
    if (get_verbose() == 0 && !running_as_daemon)
-      eputs("done");
+      eprintf("done in %1.2lf s\n", get_wall_time() - start_time);
 
 #ifndef HAVE_KRB5
    /* check for Kerberos authentication */
@@ -29860,44 +33943,121 @@ void server_loop(void)
    if (_logging_level > 0)
       write_logfile(NULL, str);
 
+   ka_init();
+
+#ifdef HAVE_EPOLL
+   /* with epoll, new connections are accepted until the listening socket runs empty */
+   ka_epoll_fd = epoll_create(N_MAX_CONNECTION);
+   if (ka_epoll_fd >= 0) {
+      fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.fd = KA_LISTEN;
+      epoll_ctl(ka_epoll_fd, EPOLL_CTL_ADD, lsock, &ev);
+   }
+   watch_generation = 0;
+#endif
+
+   accept_pending = FALSE;
+   n_ready = i_ready = 0;
+
    do {
-      FD_ZERO(&readfds);
-      FD_SET(lsock, &readfds);
-      for (i = 0; i < N_MAX_CONNECTION; i++)
-         if (ka_sock[i] > 0)
-            FD_SET(ka_sock[i], &readfds);
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
-      status = select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
+      watch_ready = FALSE;
+
+#ifdef HAVE_EPOLL
+      if (ka_epoll_fd >= 0) {
+#ifdef HAVE_INOTIFY
+         /* a new inotify descriptor is created when logbooks are indexed again, closing the
+            previous one removed it from epoll, and it often gets the same number */
+         if (el_watch_generation != watch_generation && el_watch_fd >= 0) {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = KA_WATCH;
+            epoll_ctl(ka_epoll_fd, EPOLL_CTL_ADD, el_watch_fd, &ev);
+         }
+         watch_generation = el_watch_generation;
+#endif
+
+         /* wait for new events only after the previous ones have been handled */
+         if (!accept_pending && i_ready == n_ready) {
+            status = epoll_wait(ka_epoll_fd, events, N_KA_EVENTS, 1000);
+            n_ready = i_ready = 0;
+            for (i = 0; i < status; i++) {
+               if (events[i].data.fd == KA_LISTEN)
+                  accept_pending = TRUE;
+               else if (events[i].data.fd == KA_WATCH)
+                  watch_ready = TRUE;
+               else {
+                  ready[n_ready].index = events[i].data.fd;
+                  ready[n_ready++].sock = ka_sock[events[i].data.fd];
+               }
+            }
+         } else
+            status = 1;
+      } else
+#endif
+      {
+         FD_ZERO(&readfds);
+         FD_SET(lsock, &readfds);
+         for (i = 0; i < n_ka_alloc; i++)
+            if (ka_sock[i] > 0)
+               FD_SET(ka_sock[i], &readfds);
+#ifdef HAVE_INOTIFY
+         if (el_watch_fd >= 0)
+            FD_SET(el_watch_fd, &readfds);
+#endif
+         timeout.tv_sec = 1;
+         timeout.tv_usec = 0;
+         status = select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
+
+         n_ready = i_ready = 0;
+         if (status > 0) {
+            accept_pending = FD_ISSET(lsock, &readfds);
+#ifdef HAVE_INOTIFY
+            watch_ready = el_watch_fd >= 0 && FD_ISSET(el_watch_fd, &readfds);
+#endif
+            for (i = 0; i < n_ka_alloc; i++)
+               if (ka_sock[i] > 0 && FD_ISSET(ka_sock[i], &readfds)) {
+                  ready[n_ready].index = i;
+                  ready[n_ready++].sock = ka_sock[i];
+               }
+         }
+      }
 
       /* check UNIX signal flags */
       if (_abort)
          break;
 
+#ifdef HAVE_INOTIFY
+      /* update indices of logbook files changed from outside */
+      if (watch_ready)
+         el_watch_process();
+#endif
+
+      /* give back space of tombstoned entries while nothing else is to do, and not below
+         child processes still reading the logbook files */
+      if (status == 0 && n_request_child == 0)
+         el_compact_logbooks(FALSE);
+
+      reap_request_children();
+
       /* call random number generator on each access to completely randomize it */
       rand();
 
       /* close old connections */
-      for (i = 0; i < N_MAX_CONNECTION; i++)
-         if (ka_sock[i] && (int) time(NULL) - ka_time[i] > 60) {
-#ifdef HAVE_SSL
-            if (_ssl_flag) {
-               SSL_set_fd(ka_ssl_con[i], ka_sock[i]);
-               SSL_shutdown(ka_ssl_con[i]);
-               SSL_free(ka_ssl_con[i]);
-               ka_ssl_con[i] = NULL;
-            }
-#endif
-            closesocket(ka_sock[i]);
-            ka_sock[i] = 0;
-            ka_time[i] = 0;
-         }
+      ka_expire();
 
       if (status != -1) {       // if no HUP signal is received
-         if (FD_ISSET(lsock, &readfds)) {
+         if (accept_pending) {
             len = sizeof(acc_addr);
             _sock = accept(lsock, (struct sockaddr *) &acc_addr, (void *) &len);
 
+            /* a blocking listening socket has only one connection for each select() */
+            if (_sock < 0 || ka_epoll_fd < 0)
+               accept_pending = FALSE;
+            if (_sock < 0)
+               continue;
+
 #ifdef HAVE_SSL
             if (_ssl_flag) {
                _ssl_con = SSL_new(ssl_ctx);
@@ -29905,9 +34065,8 @@ void server_loop(void)
                if (SSL_accept(_ssl_con) < 0) {
                   if (get_verbose() >= VERBOSE_INFO)
                      eprintf("SSL_accept failed\n");
+                  SSL_free(_ssl_con);
                   closesocket(_sock);
-                  ka_sock[i_conn] = 0;
-                  ka_ssl_con[i_conn] = NULL;
                   _ssl_con = NULL;
                   continue;
                }
@@ -29916,34 +34075,14 @@ void server_loop(void)
             
 #endif
 
-            /* find new entry in socket table */
-            for (i = 0; i < N_MAX_CONNECTION; i++)
-               if (ka_sock[i] == 0)
-                  break;
-            /* recycle oldest connection */
-            if (i == N_MAX_CONNECTION) {
-               for (i = i_min = 0, min = ka_time[0]; i < N_MAX_CONNECTION; i++)
-                  if (ka_time[i] < min) {
-                     min = ka_time[i];
-                     i_min = i;
-                  }
-#ifdef HAVE_SSL
-               if (_ssl_flag) {
-                  SSL_set_fd(ka_ssl_con[i_min], ka_sock[i_min]);
-                  SSL_shutdown(ka_ssl_con[i_min]);
-                  SSL_free(ka_ssl_con[i_min]);
-                  ka_ssl_con[i_min] = NULL;
-               }
-#endif
-               closesocket(ka_sock[i_min]);
-               ka_sock[i_min] = 0;
-               ka_time[i_min] = 0;
-               i = i_min;
+            /* find new entry in socket table, recycle oldest connection if it is full */
+            i = ka_open(_sock);
+            if (i < 0) {
+               ka_close(ka_oldest(), TRUE);
+               i = ka_open(_sock);
             }
 
             i_conn = i;
-            ka_sock[i_conn] = _sock;
-            ka_time[i_conn] = (int) time(NULL);
 #ifdef HAVE_SSL
             ka_ssl_con[i_conn] = _ssl_con;
 #endif
@@ -29969,225 +34108,79 @@ void server_loop(void)
             continue;
          }
 
-         /* check if open connection received data */
-         for (i = 0; i < N_MAX_CONNECTION; i++)
-            if (ka_sock[i] > 0 && FD_ISSET(ka_sock[i], &readfds))
-               break;
-         if (i == N_MAX_CONNECTION) {
-            _sock = 0;
-         } else {
-            i_conn = i;
-            _sock = ka_sock[i_conn];
+         /* take next connection which received data, skipping ones closed meanwhile */
+         _sock = 0;
+         while (i_ready < n_ready) {
+            i = ready[i_ready].index;
+            j = ready[i_ready++].sock;
+            if (ka_sock[i] > 0 && ka_sock[i] == j) {
+               i_conn = i;
+               _sock = ka_sock[i_conn];
 #ifdef HAVE_SSL
-            _ssl_con = ka_ssl_con[i_conn];
+               _ssl_con = ka_ssl_con[i_conn];
 #endif
-            ka_time[i_conn] = (int) time(NULL);
-            memcpy(&rem_addr, &remote_addr[i_conn], sizeof(rem_addr));
-            strcpy(rem_host, remote_host[i_conn]);
+               ka_touch(i_conn);
+               memcpy(&rem_addr, &remote_addr[i_conn], sizeof(rem_addr));
+               strcpy(rem_host, remote_host[i_conn]);
+               break;
+            }
          }
 
-         /* turn off keep_alive by default */
-         keep_alive = FALSE;
-
-         /* receive data */
+         /* receive data and handle the requests completed by it */
          if (_sock > 0) {
+            state = ka_read(i_conn);
 
-            memset(net_buffer, 0, net_buffer_size);
-            len = 0;
-            more_requests = 0;
-
-            do {                /* pipleline loop */
-               header_length = 0;
-               broken = FALSE;
-               return_length = -1;
-               do {
-
-                  if (!more_requests) {
-                     do {
-                        FD_ZERO(&readfds);
-                        FD_SET(_sock, &readfds);
-                        timeout.tv_sec = 6;
-                        timeout.tv_usec = 0;
-                        status = select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
-                        if (FD_ISSET(_sock, &readfds)) {
-#ifdef HAVE_SSL
-                           if (_ssl_flag)
-                              i = SSL_read(_ssl_con, net_buffer + len, net_buffer_size - len);
-                           else
-#endif
-                              i = recv(_sock, net_buffer + len, net_buffer_size - len, 0);
-
-                           if (get_verbose() == VERBOSE_URL)
-                              eprintf("Connection #%d received %d bytes on socket %d\n", i_conn, i, _sock);
-
-                        } else
-                           break;
-
-                        /* abort if connection got broken */
-                        if (i < 0) {
-                           broken = TRUE;
-                           break;
-                        }
-                        /* abort if connection has been closed */
-                        if (i == 0) {
-                           broken = TRUE;
-                           break;
-                        }
-
-                        if (i > 0)
-                           len += i;
-
-                        /* check if net_buffer needs to be increased */
-                        if (len == net_buffer_size) {
-                           net_buffer = xrealloc(net_buffer, net_buffer_size + 100000);
-                           if (net_buffer == NULL) {
-                              sprintf(str,
-                                      "Error: Cannot increase net_buffer, out of memory, net_buffer_size = %d",
-                                      net_buffer_size);
-                              show_error(str);
-                              break;
-                           }
-
-                           memset(net_buffer + net_buffer_size, 0, 100000);
-                           net_buffer_size += 100000;
-                        }
-
-                        /* repeat until empty line received (fragmented TCP packets!) */
-                     } while (strstr(net_buffer, "\r\n\r\n") == 0);
-                  }
-
-                  if (broken)
-                     break;
+            /* a connection waiting for the rest of a request is kept */
+            keep_alive = (state == KA_INCOMPLETE);
+            request_forked = FALSE;
 
-                  /* if we are in pipelining mode, clear this flag now to force a new
-                     recv if the request is not complete */
-                  more_requests = 0;
+            while (state == KA_COMPLETE || state == KA_TOO_LARGE) {
+               net_buffer = ka_request[i_conn].buffer;
 
-                  pend = NULL;
-                  if (strncmp(net_buffer, "GET", 3) == 0 && strncmp(net_buffer, "POST", 4) != 0) {
-                     if (len > 4 && strstr(net_buffer, "\r\n\r\n") != NULL) {
-                        pend = strstr(net_buffer, "\r\n\r\n") + 4;
-                        break;
-                     }
-                     if (len > 6 && strstr(net_buffer, "\r\r\n\r\r\n") != NULL) {
-                        pend = strstr(net_buffer, "\r\r\n\r\r\n") + 6;
-                        break;
-                     }
-                  } else if (strncmp(net_buffer, "POST", 4) == 0) {
-                     if (header_length == 0) {
-                        /* extract logbook */
-                        strlcpy(str, net_buffer + 6, sizeof(str));
-                        if (strstr(str, "HTTP"))
-                           *(strstr(str, "HTTP") - 1) = 0;
-                        strlcpy(logbook, str, sizeof(logbook));
-                        strlcpy(logbook_enc, str, sizeof(logbook));
-                        url_decode(logbook);
-
-                        /* extract content length */
-                        if (strstr(net_buffer, "Content-Length:"))
-                           content_length = atoi(strstr(net_buffer, "Content-Length:") + 15);
-                        else if (strstr(net_buffer, "Content-length:"))
-                           content_length = atoi(strstr(net_buffer, "Content-length:") + 15);
-
-                        /* check for valid content-length */
-                        if (content_length < 0) {
-                           broken = TRUE;
-                           break;
-                        }
+               /* turn off keep_alive by default */
+               keep_alive = FALSE;
+               return_length = -1;
 
-                        /* extract header length */
-                        if (strstr(net_buffer, "\r\n\r\n"))
-                           header_length = strstr(net_buffer, "\r\n\r\n") - net_buffer + 4;
-                        if (strstr(net_buffer, "\r\r\n\r\r\n"))
-                           header_length = strstr(net_buffer, "\r\r\n\r\r\n") - net_buffer + 6;
-
-                        if (content_length > _max_content_length) {
-
-                           /* drain socket connection */
-                           do {
-                              FD_ZERO(&readfds);
-                              FD_SET(_sock, &readfds);
-                              timeout.tv_sec = 6;
-                              timeout.tv_usec = 0;
-                              status = select(FD_SETSIZE, (void *) &readfds, NULL, NULL, (void *) &timeout);
-                              if (FD_ISSET(_sock, &readfds)) {
-#ifdef HAVE_SSL
-                                 if (_ssl_flag)
-                                    i = SSL_read(_ssl_con, net_buffer, net_buffer_size);
-                                 else
-#endif
-                                    i = recv(_sock, net_buffer, net_buffer_size, 0);
-                              } else
-                                 break;
-                           } while (i > 0);
-
-                           /* return error */
-                           memset(return_buffer, 0, return_buffer_size);
-                           strlen_retbuf = 0;
-                           return_length = 0;
-
-                           sprintf(str,
-                                   loc("Error: Content length (%d) larger than maximum content length (%d)"),
-                                   content_length, _max_content_length);
-                           strcat(str, "<br>");
-                           strcat(str,
-                                  loc
-                                  ("Please increase <b>\"Max content length\"</b> in [global] part of config file and restart elogd"));
-                           keep_alive = FALSE;
-                           show_error(str);
+               if (state == KA_TOO_LARGE) {
+                  /* return error */
+                  memset(return_buffer, 0, return_buffer_size);
+                  strlen_retbuf = 0;
+                  return_length = 0;
+
+                  sprintf(str,
+                          loc("Error: Content length (%d) larger than maximum content length (%d)"),
+                          ka_request[i_conn].content_length, _max_content_length);
+                  strcat(str, "<br>");
+                  strcat(str,
+                         loc
+                         ("Please increase <b>\"Max content length\"</b> in [global] part of config file and restart elogd"));
+                  show_error(str);
+                  keep_alive = FALSE;
 #ifdef HAVE_SSL
-                           send_return(_sock, _ssl_con, net_buffer);
+                  send_return(_sock, _ssl_con, net_buffer);
 #else
-                           send_return(_sock, net_buffer);
+                  send_return(_sock, net_buffer);
 #endif
-                           break;
-                        }
-                     }
-
-                     if (header_length > 0 && len >= header_length + content_length) {
-                        pend = net_buffer + header_length + content_length;
-                        break;
-                     }
+                  break;
+               }
 
-                  } else if (strstr(net_buffer, "HEAD") != NULL) {
+               if (strncmp(net_buffer, "GET", 3) != 0 && strncmp(net_buffer, "POST", 4) != 0) {
+                  if (strstr(net_buffer, "HEAD") != NULL) {
                      /* just return header */
                      rsprintf("HTTP/1.1 200 OK\r\n");
                      rsprintf("Server: ELOG HTTP %s-%s\r\n", VERSION, git_revision());
                      rsprintf("Connection: close\r\n");
                      rsprintf("Content-Type: text/html\r\n\r\n");
-                     keep_alive = FALSE;
                      return_length = strlen_retbuf + 1;
-                     break;
-                  } else if (strstr(net_buffer, "OPTIONS") != NULL) {
-                     return_length = -1;
-                     break;
-                  } else {
-                     if (strlen(net_buffer) > 0 && get_verbose() >= VERBOSE_INFO) {
-                        strcpy(str, "Received unknown HTTP command: ");
-                        strencode2(str, net_buffer, sizeof(str));
-                        show_error(str);
-                     }
-                     break;
+                  } else if (strstr(net_buffer, "OPTIONS") == NULL && get_verbose() >= VERBOSE_INFO) {
+                     strcpy(str, "Received unknown HTTP command: ");
+                     strencode2(str, net_buffer, sizeof(str));
+                     show_error(str);
                   }
-
-               } while (1);
-
-               if (broken) {
-                  if (get_verbose() >= VERBOSE_URL)
-                     eprintf("TCP connection #%d on socket %d closed\n", i_conn, _sock);
-                  keep_alive = FALSE;
-                  break;
-               }
-
-               if (strncmp(net_buffer, "POST", 4) == 0 && len < header_length + content_length) {
-                  if (get_verbose() >= VERBOSE_INFO)
-                     eprintf("Incomplete POST request\n");
-                  keep_alive = FALSE;
-                  break;
                }
 
                /* now process HTTP request and put the result into the return_buffer */
-               if (process_http_request(net_buffer, i_conn)) {
+               if (process_http_request(net_buffer, i_conn) && !request_forked) {
 
                   /* send back the return_buffer to the browser */
 #ifdef HAVE_SSL
@@ -30196,30 +34189,41 @@ void server_loop(void)
                   send_return(_sock, net_buffer);
 #endif
                }
+               el_entry_cache_report();
+               el_regex_cache_report();
 
-               /* check if the net_buffer contains more than one request (pipelining) */
-               if (pend && *pend) {
-                  memmove(net_buffer, pend, strlen(pend) + 1);
-                  more_requests = 1;
-                  len -= (pend - net_buffer);
+               /* a child process closes its connection and exits after the request */
+               if (request_child) {
+#ifdef HAVE_SSL
+                  if (_ssl_flag) {
+                     SSL_shutdown(_ssl_con);
+                     SSL_free(_ssl_con);
+                  }
+#endif
+                  closesocket(_sock);
+                  _exit(EXIT_SUCCESS);
                }
 
-            } while (more_requests);
-
-            if (!keep_alive) {
-#ifdef HAVE_SSL
-               if (_ssl_flag) {
-                  SSL_shutdown(_ssl_con);
-                  SSL_free(_ssl_con);
+               /* the connection belongs to the child process now */
+               if (request_forked) {
+                  keep_alive = FALSE;
+                  break;
                }
-#endif
 
-               closesocket(_sock);
-               ka_sock[i_conn] = 0;
-#ifdef HAVE_SSL
-               ka_ssl_con[i_conn] = NULL;
-#endif
+               /* continue with next request if several were sent at once (pipelining),
+                  unless the connection is to be closed after this response */
+               state = keep_alive ? ka_next_request(i_conn) : KA_BROKEN;
             }
+
+            if (state == KA_BROKEN || ka_request[i_conn].eof) {
+               if (get_verbose() >= VERBOSE_URL)
+                  eprintf("TCP connection #%d on socket %d closed\n", i_conn, _sock);
+               keep_alive = FALSE;
+            }
+
+            /* do not end an SSL session continued by a child process */
+            if (!keep_alive)
+               ka_close(i_conn, !request_forked);
          }
       }
 #ifdef OS_WINNT
@@ -30246,19 +34250,8 @@ void server_loop(void)
    eprintf("elogd server aborted.\n");
 
    /* free all allocated memory */
-   for (i = 0; lb_list[i].name[0]; i++) {
-      if (lb_list[i].el_index) {
-         xfree(lb_list[i].el_index);
-         lb_list[i].el_index = NULL;
-      }
-
-      if (lb_list[i].n_el_index) {
-         xfree(lb_list[i].n_el_index);
-         lb_list[i].n_el_index = NULL;
-      }
-   }
+   el_free_index(lb_list);
 
-   xfree(net_buffer);
    xfree(return_buffer);
    free_config();
 }
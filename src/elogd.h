@@ -46,6 +46,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include <locale.h>
 
@@ -127,6 +128,21 @@ typedef int BOOL;
 #include <grp.h>
 #include <syslog.h>
 #include <termios.h>
+#include <pthread.h>
+#include <poll.h>
+
+#ifdef __linux__
+#define HAVE_INOTIFY
+#include <sys/inotify.h>
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#define HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define closesocket(s) close(s)
 
@@ -194,6 +210,7 @@ typedef int BOOL;
 #define MAX_PATH_LENGTH 256
 
 #define MAX_CONTENT_LENGTH 10*1024*1024
+#define N_MAX_RANGE      16     /* byte ranges served from one request */
 
 /* attribute flags */
 #define AF_REQUIRED           (1<<0)
@@ -220,15 +237,64 @@ typedef int BOOL;
 #define AFF_EXTENDABLE             8
 
 typedef struct {
-   int message_id;
    char subdir[256];
    char file_name[32];
+   int dead_size;               /* size of tombstoned records in file */
+} EL_FILE;
+
+typedef struct {
+   int n;                       /* number of files */
+   int size;                    /* number of allocated records */
+   EL_FILE *file;
+} EL_FILE_TABLE;
+
+typedef struct {
+   char *name;
+   int n_values;                /* number of distinct values, code 0 is "" */
+   int size_values;
+   char **value;
+   int hash_size;
+   int *hash;                   /* value code plus one, zero for empty slot */
+   int *code;                   /* value code per row */
+} EL_ATTR_COLUMN;
+
+#define EL_TEXT_BUCKETS 16384
+
+typedef struct {
+   unsigned char *data;         /* rows as variable length differences to previous row */
+   int size;
+   int alloc;
+   int last;                    /* last row in list */
+} EL_TEXT_LIST;
+
+typedef struct {
+   int n_rows;
+   int size_rows;
+   int n_columns;
+   EL_ATTR_COLUMN *column;
+   EL_TEXT_LIST *text;          /* rows per trigram bucket, NULL if no text index */
+} EL_ATTR_TABLE;
+
+typedef struct {
    time_t file_time;
-   int offset;
+   int message_id;
    int in_reply_to;
+   int thread_head;             /* ID of first entry in thread */
+   int first_reply;             /* ID of first reply, 0 if none */
+   int next_reply;              /* ID of next reply to same entry, 0 if none */
+   int file_id;                 /* position in file table of logbook */
+   int offset;
+   int attr_row;                /* row in attribute table, -1 if unknown */
    unsigned char md5_digest[16];
 } EL_INDEX;
 
+typedef struct {
+   int size;                    /* number of slots, power of two */
+   int n;                       /* number of used slots */
+   int max_id;                  /* highest message ID in index */
+   int *slot;                   /* index in el_index plus one, zero for empty slot */
+} EL_ID_HASH;
+
 typedef struct {
    char name[256];
    char name_enc[256];
@@ -236,6 +302,9 @@ typedef struct {
    char top_group[256];
    EL_INDEX *el_index;
    int *n_el_index;
+   EL_ID_HASH *id_hash;
+   EL_FILE_TABLE *el_files;
+   EL_ATTR_TABLE *el_attr;
    int n_attr;
    PMXML_NODE pwd_xml_tree;
 } LOGBOOK;
@@ -254,10 +323,15 @@ typedef struct LBNODE {
    int is_top;
 } LBNODE;
 
+typedef union {
+   double number;
+   int string;
+} MSG_KEY;
+
 typedef struct {
    LOGBOOK *lbs;
    int index;
-   char string[256];
+   MSG_KEY *key;
    int number;
    int in_reply_to;
 } MSG_LIST;
@@ -302,6 +376,8 @@ void highlight_searchtext(regex_t * re_buf, char *src, char *dst, BOOL hidden);
 int parse_config_file(char *config_file);
 PMXML_NODE load_password_file(LOGBOOK * lbs, char *error, int error_size);
 int load_password_files();
+int get_entry_cache_size(void);
+void el_entry_cache_clear(int max_size);
 BOOL check_login(LOGBOOK * lbs, char *sid);
 void compose_base_url(LOGBOOK * lbs, char *base_url, int size, BOOL email_notify);
 void show_elog_entry(LOGBOOK * lbs, char *dec_path, char *command);